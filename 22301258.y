@@ -1,10 +1,14 @@
 %{
 
 #include "symbol_table.h"
+#include "switch_lowering.h"
+#include "call_graph.h"
+#include "loop_optimizer.h"
+#include "token_stream.h"
 
 #define YYSTYPE symbol_info*
 
-extern FILE *yyin;
+FILE *yyin; // read whole by token_stream, the scanner itself is reentrant
 int yyparse(void);
 int yylex(void);
 extern YYSTYPE yylval;
@@ -20,6 +24,13 @@ vector<pair<string, int>> var_list; // (name, array_size) -1 for non-array
 string current_func_name = "";
 string current_func_return_type = "";
 vector<pair<string, string>> current_func_params; // (type, name)
+vector<switch_lowering> switch_stack; // innermost switch last
+string enclosing_func_name = ""; // function whose body is being parsed
+call_graph calls;
+loop_optimizer loops;
+token_stream tokens;
+int lex_threads = 1;
+bool check_scanner = false;
 
 void yyerror(char *s)
 {
@@ -31,11 +42,45 @@ void yyerror(char *s)
 	current_func_name = "";
 	current_func_return_type = "";
 	current_func_params.clear();
+	loops.reset();
+
+	// Leave the scopes of unfinished switches and of any block opened inside them;
+	// scope ids only grow, so those are all at or above the outermost switch's
+	if (!switch_stack.empty())
+	{
+		int outermost = switch_stack.front().get_scope_id();
+		while (table->get_current_scope() != NULL && table->get_current_scope()->get_unique_id() >= outermost)
+		{
+			table->exit_scope();
+		}
+	}
+	switch_stack.clear();
+}
+
+int yylex(void)
+{
+	return tokens.next(yylval, lines);
+}
+
+// Records a case label of the innermost switch. The literal is parsed with strtoll,
+// stoll would throw on one outside the long long range.
+void add_case_label(string value)
+{
+	errno = 0;
+	long long label = strtoll(value.c_str(), NULL, 10);
+	if (errno == ERANGE)
+	{
+		outlog << "Error at line " << lines << ": Case value " << value << " out of range" << endl << endl;
+	}
+	else if (!switch_stack.back().add_case(label))
+	{
+		outlog << "Error at line " << lines << ": Duplicate case value " << value << endl << endl;
+	}
 }
 
 %}
 
-%token IF ELSE FOR WHILE DO BREAK INT CHAR FLOAT DOUBLE VOID RETURN SWITCH CASE DEFAULT CONTINUE PRINTLN ADDOP MULOP INCOP DECOP RELOP ASSIGNOP LOGICOP NOT LPAREN RPAREN LCURL RCURL LTHIRD RTHIRD COMMA SEMICOLON CONST_INT CONST_FLOAT ID
+%token IF ELSE FOR WHILE DO BREAK INT CHAR FLOAT DOUBLE VOID RETURN SWITCH CASE DEFAULT CONTINUE PRINTLN ADDOP MULOP INCOP DECOP RELOP ASSIGNOP LOGICOP NOT LPAREN RPAREN LCURL RCURL LTHIRD RTHIRD COMMA SEMICOLON COLON CONST_INT CONST_FLOAT ID
 
 %nonassoc LOWER_THAN_ELSE
 %nonassoc ELSE
@@ -48,6 +93,17 @@ start : program
 		outlog << "Symbol Table" << endl << endl;
 		
 		table->print_all_scopes(outlog);
+
+		vector<string> inline_report;
+		string inlined = calls.inline_calls($1->getname(), inline_report);
+		for (auto line : inline_report)
+		{
+			outlog << line << endl << endl;
+		}
+		if (inlined != $1->getname())
+		{
+			outlog << "Program after inlining:" << endl << inlined << endl << endl;
+		}
 	}
 	;
 
@@ -87,6 +143,7 @@ func_definition : type_specifier ID LPAREN parameter_list RPAREN
 		{
 			current_func_name = $2->get_name();
 			current_func_return_type = $1->get_name();
+			enclosing_func_name = $2->get_name();
 			
 			// Insert function into symbol table
 			symbol_info *func = new symbol_info($2->get_name(), "ID");
@@ -123,11 +180,10 @@ func_definition : type_specifier ID LPAREN parameter_list RPAREN
 			
 			$$ = new symbol_info($1->getname() + " " + $2->getname() + "(" + $4->getname() + ")\n" + $7->getname(), "func_def");	
 			
-			// Print and exit scope
-			table->print_all_scopes(outlog);
-			outlog << "ScopeTable # " << table->get_current_scope()->get_unique_id() << " removed" << endl << endl;
-			table->exit_scope();
+			// The function scope was printed and exited by compound_statement
 			
+			calls.add_function($2->get_name(), $1->get_name(), current_func_params, $7->getname());
+			enclosing_func_name = "";
 			current_func_params.clear();
 			current_func_name = "";
 			current_func_return_type = "";
@@ -136,6 +192,7 @@ func_definition : type_specifier ID LPAREN parameter_list RPAREN
 		{
 			current_func_name = $2->get_name();
 			current_func_return_type = $1->get_name();
+			enclosing_func_name = $2->get_name();
 			
 			// Insert function into symbol table
 			symbol_info *func = new symbol_info($2->get_name(), "ID");
@@ -159,11 +216,10 @@ func_definition : type_specifier ID LPAREN parameter_list RPAREN
 			
 			$$ = new symbol_info($1->getname() + " " + $2->getname() + "()\n" + $6->getname(), "func_def");	
 			
-			// Print and exit scope
-			table->print_all_scopes(outlog);
-			outlog << "ScopeTable # " << table->get_current_scope()->get_unique_id() << " removed" << endl << endl;
-			table->exit_scope();
+			// The function scope was printed and exited by compound_statement
 			
+			calls.add_function($2->get_name(), $1->get_name(), vector<pair<string, string>>(), $6->getname());
+			enclosing_func_name = "";
 			current_func_name = "";
 			current_func_return_type = "";
 		}
@@ -257,16 +313,15 @@ compound_statement : LCURL
  		    }
  		    ;
  		    
-var_declaration : type_specifier 
-		{
-			current_var_type = $1->get_name();
-		}
-		declaration_list SEMICOLON
+var_declaration : type_specifier declaration_list SEMICOLON
 		 {
 			outlog << "At line no: " << lines << " var_declaration : type_specifier declaration_list SEMICOLON " << endl << endl;
-			outlog << $1->getname() << " " << $3->getname() << ";" << endl << endl;
+			outlog << $1->getname() << " " << $2->getname() << ";" << endl << endl;
 			
-			$$ = new symbol_info($1->getname() + " " + $3->getname() + ";", "var_dec");
+			$$ = new symbol_info($1->getname() + " " + $2->getname() + ";", "var_dec");
+			
+			// Set here rather than in a mid-rule action, which conflicts with func_definition on ID
+			current_var_type = $1->get_name();
 			
 			// Insert variables into symbol table
 			for (auto var : var_list)
@@ -289,6 +344,7 @@ var_declaration : type_specifier
 					outlog << "Error at line " << lines << ": Multiple declaration of " << var.first << endl << endl;
 					delete s;
 				}
+				calls.add_variable(enclosing_func_name, current_var_type, var.first);
 			}
 			
 			var_list.clear();
@@ -395,12 +451,30 @@ statement : var_declaration
 			
 			$$ = new symbol_info($1->getname(), "stmnt");
 	  }
-	  | FOR LPAREN expression_statement expression_statement expression RPAREN statement
+	  | FOR LPAREN
+	  {
+			loops.enter_loop(lines);
+	  }
+	  expression_statement
+	  {
+			loops.begin_iterations();
+	  }
+	  expression_statement expression RPAREN statement
 	  {
 	    	outlog << "At line no: " << lines << " statement : FOR LPAREN expression_statement expression_statement expression RPAREN statement " << endl << endl;
-			outlog << "for(" << $3->getname() << $4->getname() << $5->getname() << ")\n" << $7->getname() << endl << endl;
+			outlog << "for(" << $4->getname() << $6->getname() << $7->getname() << ")\n" << $9->getname() << endl << endl;
 			
-			$$ = new symbol_info("for(" + $3->getname() + $4->getname() + $5->getname() + ")\n" + $7->getname(), "stmnt");
+			$$ = new symbol_info("for(" + $4->getname() + $6->getname() + $7->getname() + ")\n" + $9->getname(), "stmnt");
+
+			string unrolled;
+			for (auto line : loops.exit_for($4->getname(), $6->getname(), $7->getname(), $9->getname(), unrolled))
+			{
+				outlog << line << endl << endl;
+			}
+			if (!unrolled.empty())
+			{
+				outlog << "After unrolling:" << endl << unrolled << endl << endl;
+			}
 	  }
 	  | IF LPAREN expression RPAREN statement %prec LOWER_THAN_ELSE
 	  {
@@ -416,12 +490,21 @@ statement : var_declaration
 			
 			$$ = new symbol_info("if(" + $3->getname() + ")\n" + $5->getname() + "\nelse\n" + $7->getname(), "stmnt");
 	  }
-	  | WHILE LPAREN expression RPAREN statement
+	  | WHILE LPAREN
+	  {
+			loops.enter_loop(lines);
+	  }
+	  expression RPAREN statement
 	  {
 	    	outlog << "At line no: " << lines << " statement : WHILE LPAREN expression RPAREN statement " << endl << endl;
-			outlog << "while(" << $3->getname() << ")\n" << $5->getname() << endl << endl;
+			outlog << "while(" << $4->getname() << ")\n" << $6->getname() << endl << endl;
 			
-			$$ = new symbol_info("while(" + $3->getname() + ")\n" + $5->getname(), "stmnt");
+			$$ = new symbol_info("while(" + $4->getname() + ")\n" + $6->getname(), "stmnt");
+
+			for (auto line : loops.exit_while($4->getname()))
+			{
+				outlog << line << endl << endl;
+			}
 	  }
 	  | PRINTLN LPAREN ID RPAREN SEMICOLON
 	  {
@@ -434,10 +517,106 @@ statement : var_declaration
 	  {
 	    	outlog << "At line no: " << lines << " statement : RETURN expression SEMICOLON " << endl << endl;
 			outlog << "return " << $2->getname() << ";" << endl << endl;
-			
+
 			$$ = new symbol_info("return " + $2->getname() + ";", "stmnt");
 	  }
+	  | BREAK SEMICOLON
+	  {
+	    	outlog << "At line no: " << lines << " statement : BREAK SEMICOLON " << endl << endl;
+			outlog << "break;" << endl << endl;
+
+			$$ = new symbol_info("break;", "stmnt");
+	  }
+	  | SWITCH LPAREN expression RPAREN LCURL
+	  {
+			// The switch body is a block of its own
+			table->enter_scope();
+			outlog << "New ScopeTable # " << table->get_current_scope()->get_unique_id() << " created" << endl << endl;
+
+			switch_stack.push_back(switch_lowering(lines, table->get_current_scope()->get_unique_id()));
+	  }
+	  case_list RCURL
+	  {
+	    	outlog << "At line no: " << lines << " statement : SWITCH LPAREN expression RPAREN LCURL case_list RCURL " << endl << endl;
+			string cases = $7->getname().empty() ? "" : $7->getname() + "\n";
+			outlog << "switch(" << $3->getname() << ")\n{\n" << cases << "}" << endl << endl;
+
+			$$ = new symbol_info("switch(" + $3->getname() + ")\n{\n" + cases + "}", "stmnt");
+
+			outlog << "Switch at line " << switch_stack.back().get_start_line() << " lowered to " << switch_stack.back().choose_lowering() << endl << endl;
+			switch_stack.pop_back();
+
+			table->print_all_scopes(outlog);
+			outlog << "ScopeTable # " << table->get_current_scope()->get_unique_id() << " removed" << endl << endl;
+			table->exit_scope();
+	  }
 	  ;
+
+case_list : case_list case_clause
+		  {
+				outlog << "At line no: " << lines << " case_list : case_list case_clause " << endl << endl;
+				string joined = $1->getname().empty() ? $2->getname() : $1->getname() + "\n" + $2->getname();
+				outlog << joined << endl << endl;
+
+				$$ = new symbol_info(joined, "case_list");
+		  }
+		  |
+		  {
+				// switch(x){} is valid C
+				outlog << "At line no: " << lines << " case_list :  " << endl << endl;
+				outlog << "" << endl << endl;
+
+				$$ = new symbol_info("", "case_list");
+		  }
+		  ;
+
+case_clause : case_label statements
+			{
+				outlog << "At line no: " << lines << " case_clause : case_label statements " << endl << endl;
+				outlog << $1->getname() << "\n" << $2->getname() << endl << endl;
+
+				$$ = new symbol_info($1->getname() + "\n" + $2->getname(), "case_clause");
+			}
+			| case_label
+			{
+				outlog << "At line no: " << lines << " case_clause : case_label " << endl << endl;
+				outlog << $1->getname() << endl << endl;
+
+				$$ = new symbol_info($1->getname(), "case_clause");
+			}
+			;
+
+case_label : CASE CONST_INT COLON
+		   {
+				outlog << "At line no: " << lines << " case_label : CASE CONST_INT COLON " << endl << endl;
+				outlog << "case " << $2->getname() << ":" << endl << endl;
+
+				$$ = new symbol_info("case " + $2->getname() + ":", "case_label");
+
+				add_case_label($2->get_name());
+		   }
+		   | CASE ADDOP CONST_INT COLON
+		   {
+				outlog << "At line no: " << lines << " case_label : CASE ADDOP CONST_INT COLON " << endl << endl;
+				outlog << "case " << $2->getname() << $3->getname() << ":" << endl << endl;
+
+				$$ = new symbol_info("case " + $2->getname() + $3->getname() + ":", "case_label");
+
+				add_case_label($2->get_name() + $3->get_name());
+		   }
+		   | DEFAULT COLON
+		   {
+				outlog << "At line no: " << lines << " case_label : DEFAULT COLON " << endl << endl;
+				outlog << "default:" << endl << endl;
+
+				$$ = new symbol_info("default:", "case_label");
+
+				if (!switch_stack.back().set_default())
+				{
+					outlog << "Error at line " << lines << ": Multiple default labels in one switch" << endl << endl;
+				}
+		   }
+		   ;
 	  
 expression_statement : SEMICOLON
 			{
@@ -468,6 +647,10 @@ variable : ID
 		outlog << $1->getname() << "[" << $3->getname() << "]" << endl << endl;
 		
 		$$ = new symbol_info($1->getname() + "[" + $3->getname() + "]", "varbl");
+
+		symbol_info *array = table->lookup($1);
+		int array_size = (array != NULL && array->get_symbol_type() == "array") ? array->get_array_size() : -1;
+		loops.record_array_access($1->get_name(), $3->getname(), array_size);
 	 }
 	 ;
 	 
@@ -484,6 +667,8 @@ expression : logic_expression
 			outlog << $1->getname() << "=" << $3->getname() << endl << endl;
 
 			$$ = new symbol_info($1->getname() + "=" + $3->getname(), "expr");
+
+			loops.record_assignment($1->getname(), $1->getname() + "=" + $3->getname());
 	   }
 	   ;
 			
@@ -532,6 +717,8 @@ simple_expression : term
 			outlog << $1->getname() << $2->getname() << $3->getname() << endl << endl;
 			
 			$$ = new symbol_info($1->getname() + $2->getname() + $3->getname(), "simp_expr");
+
+			loops.record_expression($1->getname() + $2->getname() + $3->getname());
 	      }
 		  ;
 					
@@ -548,6 +735,8 @@ term :	unary_expression
 			outlog << $1->getname() << $2->getname() << $3->getname() << endl << endl;
 			
 			$$ = new symbol_info($1->getname() + $2->getname() + $3->getname(), "term");
+
+			loops.record_expression($1->getname() + $2->getname() + $3->getname());
 	 }
      ;
 
@@ -587,6 +776,9 @@ factor	: variable
 		outlog << $1->getname() << "(" << $3->getname() << ")" << endl << endl;
 
 		$$ = new symbol_info($1->getname() + "(" + $3->getname() + ")", "fctr");
+
+		calls.add_call(enclosing_func_name, $1->get_name());
+		loops.record_call();
 	}
 	| LPAREN expression RPAREN
 	{
@@ -615,6 +807,8 @@ factor	: variable
 		outlog << $1->getname() << "++" << endl << endl;
 			
 		$$ = new symbol_info($1->getname() + "++", "fctr");
+
+		loops.record_assignment($1->getname(), $1->getname() + "++");
 	}
 	| variable DECOP
 	{
@@ -622,6 +816,8 @@ factor	: variable
 		outlog << $1->getname() << "--" << endl << endl;
 			
 		$$ = new symbol_info($1->getname() + "--", "fctr");
+
+		loops.record_assignment($1->getname(), $1->getname() + "--");
 	}
 	;
 	
@@ -662,12 +858,34 @@ arguments : arguments COMMA logic_expression
 
 int main(int argc, char *argv[])
 {
-	if(argc != 2) 
+	char *input_file = NULL;
+	for (int i = 1; i < argc; i++)
 	{
-		cout << "input1.c" << endl;
+		string arg = argv[i];
+		if (arg.compare(0, 9, "--unroll=") == 0)
+		{
+			loops.set_unroll_factor(atoi(arg.substr(9).c_str()));
+		}
+		else if (arg.compare(0, 14, "--lex-threads=") == 0)
+		{
+			lex_threads = max(1, atoi(arg.substr(14).c_str()));
+		}
+		else if (arg == "--check-scanner")
+		{
+			check_scanner = true;
+		}
+		else
+		{
+			input_file = argv[i];
+		}
+	}
+
+	if(input_file == NULL) 
+	{
+		cout << "input1.c [--unroll=N] [--lex-threads=N] [--check-scanner]" << endl;
 		return 0;
 	}
-	yyin = fopen(argv[1], "r");
+	yyin = fopen(input_file, "r");
 	outlog.open("output.txt", ios::trunc);
 	
 	if(yyin == NULL)
@@ -680,9 +898,29 @@ int main(int argc, char *argv[])
 	table = new symbol_table(10);
 	outlog << "ScopeTable # " << table->get_current_scope()->get_unique_id() << " created" << endl << endl;
 
+	if (!tokens.load(yyin, lex_threads))
+	{
+		cout << "Couldn't read file" << endl;
+		return 0;
+	}
+
+	if (check_scanner)
+	{
+		string report;
+		bool same = tokens.check_scanners(report);
+		outlog << "Scanner check " << (same ? "passed: " : "failed: ") << report << endl << endl;
+		cout << "Scanner check " << (same ? "passed: " : "failed: ") << report << endl;
+	}
+
 	yyparse();
 	
 	outlog << endl << "Total lines: " << lines << endl;
+
+	if (lex_threads > 1)
+	{
+		outlog << "Lexed " << tokens.get_token_count() << " tokens in " << tokens.get_chunk_count()
+			   << " chunks on " << lex_threads << " threads in " << tokens.get_lex_millis() << " ms" << endl;
+	}
 	
 	delete table;
 	
@@ -691,4 +929,4 @@ int main(int argc, char *argv[])
 	fclose(yyin);
 	
 	return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,531 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_minivsfs.c -o bench_minivsfs
+// Benchmarks the MiniVSFS tools. For every file set (--dist, repeatable) it writes the
+// files and a manifest under the work directory once; then, for every combination of
+// --size-kib and --inodes, it builds a fresh image with the builder and ingests the set
+// with the adder, both run with --stats=json. One row per run gives MB/s, files/s, I/O
+// calls per file and peak RSS from the tool's own counters, with the per-phase times
+// after them; --out appends the rows to a file as well, to compare runs over time.
+// File sizes are drawn from a fixed seed, so every run of a sweep sees the same set.
+// --crc instead checks the shared CRC32 engine (minivsfs_crc.h) against a bitwise
+// reference and against its update/combine identities, then reports its throughput.
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "minivsfs_crc.h"
+
+#define MAX_SWEEP 32
+#define MAX_DISTS 16
+#define MAX_EXTRA_ARGS 32
+
+// ====================== File sets ======================
+// fixed:<bytes>, uniform:<min>-<max>, or mix:<small>,<large>,<percent large>
+typedef struct {
+    char spec[64];
+    int kind;
+    uint64_t a, b, pct;
+} dist_t;
+
+enum { DIST_FIXED, DIST_UNIFORM, DIST_MIX };
+
+static int parse_dist(const char *s, dist_t *d) {
+    memset(d, 0, sizeof(*d));
+    snprintf(d->spec, sizeof(d->spec), "%s", s);
+    if (sscanf(s, "fixed:%" SCNu64, &d->a) == 1) {
+        d->kind = DIST_FIXED;
+        return 0;
+    }
+    if (sscanf(s, "uniform:%" SCNu64 "-%" SCNu64, &d->a, &d->b) == 2 && d->a <= d->b) {
+        d->kind = DIST_UNIFORM;
+        return 0;
+    }
+    if (sscanf(s, "mix:%" SCNu64 ",%" SCNu64 ",%" SCNu64, &d->a, &d->b, &d->pct) == 3 && d->pct <= 100) {
+        d->kind = DIST_MIX;
+        return 0;
+    }
+    return -1;
+}
+
+// xorshift64*: fast, and the same sequence on every machine
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t draw_size(const dist_t *d, uint64_t *state) {
+    switch (d->kind) {
+    case DIST_UNIFORM: return d->a + next_random(state) % (d->b - d->a + 1);
+    case DIST_MIX: return next_random(state) % 100 < d->pct ? d->b : d->a;
+    default: return d->a;
+    }
+}
+
+// Half random bytes, half runs of a repeated word, so --compress and --dedup have
+// something to find without every block being the same
+static void fill_block(uint8_t *buf, size_t len, uint64_t *state) {
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t v = next_random(state);
+        memcpy(buf + i, &v, len - i < 8 ? len - i : 8);
+    }
+    static const char word[] = "minivsfs ";
+    for (size_t i = len / 2; i < len; i++) buf[i] = (uint8_t)word[i % (sizeof(word) - 1)];
+}
+
+// Writes `count` files under dir/set<index>/ and their manifest. Returns the total size,
+// or -1 with a message.
+static int64_t make_file_set(const char *dir, int index, const dist_t *d, int count, char *manifest, size_t cap) {
+    char set_dir[4000];
+    snprintf(set_dir, sizeof(set_dir), "%s/set%d", dir, index);
+    if (mkdir(set_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir file set");
+        return -1;
+    }
+    snprintf(manifest, cap, "%s/manifest", set_dir);
+    FILE *list = fopen(manifest, "w");
+    if (!list) {
+        perror("create manifest");
+        return -1;
+    }
+
+    static uint8_t buf[1u << 16];
+    uint64_t state = 0x9E3779B97F4A7C15ULL + (uint64_t)index;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        char path[4096 + 32];
+        snprintf(path, sizeof(path), "%s/f%d", set_dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("create file");
+            fclose(list);
+            return -1;
+        }
+        uint64_t size = draw_size(d, &state);
+        for (uint64_t done = 0; done < size; ) {
+            size_t len = size - done < sizeof(buf) ? (size_t)(size - done) : sizeof(buf);
+            fill_block(buf, len, &state);
+            if (write(fd, buf, len) != (ssize_t)len) {
+                perror("write file");
+                close(fd);
+                fclose(list);
+                return -1;
+            }
+            done += len;
+        }
+        close(fd);
+        fprintf(list, "%s\n", path);
+        total += (int64_t)size;
+    }
+    if (fclose(list) != 0) {
+        perror("write manifest");
+        return -1;
+    }
+    return total;
+}
+
+// ====================== CRC32 ======================
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// One bit at a time, straight from the polynomial: shares nothing with the engine
+static uint32_t crc32_bitwise(const uint8_t *p, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    while (n--) {
+        c ^= *p++;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32_POLY & (0u - (c & 1)));
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t crc32_tables_only(const uint8_t *p, size_t n) {
+    return crc32_slice8(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+}
+
+#ifdef CRC32_HAVE_CLMUL
+// The folding path on its own for the bulk, as crc32_update() splits it
+static uint32_t crc32_clmul_only(const uint8_t *p, size_t n) {
+    size_t bulk = n & ~(size_t)15;
+    uint32_t c = crc32_clmul(0xFFFFFFFFu, p, bulk);
+    return crc32_slice8(c, p + bulk, n - bulk) ^ 0xFFFFFFFFu;
+}
+#endif
+
+// Every length up to 1 KiB and a few larger ones, each at several alignments. Returns
+// the number of mismatches, printing the first few.
+static int crc_check(const uint8_t *buf, size_t cap, uint64_t *state) {
+    static const size_t big[] = { 4095, 4096, 4097, 65536 - 64, 65536 - 7 };
+    int failures = 0;
+    uint64_t checked = 0;
+
+    for (size_t i = 0; i < 1025 + sizeof(big) / sizeof(big[0]); i++) {
+        size_t n = i < 1025 ? i : big[i - 1025];
+        for (size_t offset = 0; offset < 8 && offset + n <= cap; offset += 3) {
+            const uint8_t *p = buf + offset;
+            uint32_t want = crc32_bitwise(p, n);
+            uint32_t tables = crc32_tables_only(p, n);
+            uint32_t clmul = want;
+#ifdef CRC32_HAVE_CLMUL
+            if (crc32_use_clmul && n >= 64) clmul = crc32_clmul_only(p, n);
+#endif
+            uint32_t whole = crc32(p, n);
+
+            // One split at each end and one at random: a and b may both be empty
+            size_t splits[3] = { 0, n, n ? (size_t)(next_random(state) % (n + 1)) : 0 };
+            int split_failed = 0;
+            for (int k = 0; k < 3; k++) {
+                size_t a = splits[k];
+                uint32_t crc_a = crc32(p, a), crc_b = crc32(p + a, n - a);
+                if (crc32_update(crc_a, p + a, n - a) != want || crc32_combine(crc_a, crc_b, n - a) != want)
+                    split_failed = 1;
+            }
+
+            checked++;
+            if (tables != want || clmul != want || whole != want || split_failed) {
+                if (failures++ < 5)
+                    fprintf(stderr, "CRC mismatch at length %zu, offset %zu: bitwise %08x, tables %08x, "
+                                    "clmul %08x, crc32 %08x%s\n", n, offset, want, tables, clmul, whole,
+                            split_failed ? ", update/combine identity broken" : "");
+            }
+        }
+    }
+    printf("crc32: %" PRIu64 " buffers checked against the bitwise reference, %d mismatch(es)\n", checked, failures);
+    return failures;
+}
+
+static void crc_throughput(const char *name, uint32_t (*fn)(const uint8_t *, size_t),
+                           const uint8_t *buf, size_t len, uint64_t total) {
+    volatile uint32_t sink;     // keeps the calls from being optimised away
+    uint64_t rounds = total / len;
+    uint64_t started = now_ns();
+    for (uint64_t r = 0; r < rounds; r++) sink = fn(buf, len);
+    uint64_t ns = now_ns() - started;
+    (void)sink;
+    printf("%-12s %8zu %10.1f\n", name, len, ns ? (double)(rounds * len) / 1e6 / ((double)ns / 1e9) : 0.0);
+}
+
+static uint32_t crc32_dispatch(const uint8_t *p, size_t n) {
+    return crc32(p, n);
+}
+
+static uint32_t crc32_bitwise_bench(const uint8_t *p, size_t n) {
+    return crc32_bitwise(p, n);
+}
+
+static int run_crc(void) {
+    static uint8_t buf[1u << 16];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    fill_block(buf, sizeof(buf), &state);
+    crc32_init();
+
+    int failures = crc_check(buf, sizeof(buf), &state);
+
+    // Ingest checksums whole blocks, fsck and extract whole files
+    static const size_t lens[] = { 64, 4096, 65536 };
+    printf("%-12s %8s %10s\n", "engine", "bytes", "MB/s");
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        crc_throughput("bitwise", crc32_bitwise_bench, buf, lens[i], 16ull << 20);
+        crc_throughput("tables", crc32_tables_only, buf, lens[i], 256ull << 20);
+#ifdef CRC32_HAVE_CLMUL
+        if (crc32_use_clmul && lens[i] >= 64) crc_throughput("clmul", crc32_clmul_only, buf, lens[i], 1024ull << 20);
+#endif
+        crc_throughput("crc32", crc32_dispatch, buf, lens[i], 1024ull << 20);
+    }
+    return failures ? 1 : 0;
+}
+
+// ====================== Tool runs ======================
+// Runs argv with stdout captured into out (NUL-terminated, truncated to cap). Returns the
+// exit status, or -1 if the tool could not be run.
+static int run_tool(char *const argv[], char *out, size_t cap) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(pipefd[1]);
+
+    // The adder prints a line per file: keep the end, where the stats are
+    size_t used = 0;
+    for (;;) {
+        if (used == cap - 1) {
+            memmove(out, out + cap / 2, used - cap / 2);
+            used -= cap / 2;
+        }
+        ssize_t n = read(pipefd[0], out + used, cap - 1 - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += (size_t)n;
+    }
+    out[used] = '\0';
+    close(pipefd[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+typedef struct {
+    uint64_t files, file_bytes, wall_ns;
+    uint64_t layout_ns, bitmap_ns, alloc_ns, copy_ns, writeback_ns;
+    uint64_t io_calls, bytes_read, bytes_written, peak_rss_kib;
+} run_stats_t;
+
+// Value of "key": in a flat search of the JSON line; every key the tools print is unique
+static int json_u64(const char *json, const char *key, uint64_t *out) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(json, pattern);
+    if (!p) return -1;
+    *out = strtoull(p + strlen(pattern), NULL, 10);
+    return 0;
+}
+
+// Finds the --stats=json line (the last one starting with '{') in a tool's output
+static int parse_stats(const char *out, run_stats_t *s) {
+    const char *line = NULL;
+    for (const char *p = out; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        if (*p == '{') line = p;
+    }
+    if (!line) return -1;
+
+    struct { const char *key; uint64_t *field; } keys[] = {
+        {"files", &s->files}, {"file_bytes", &s->file_bytes}, {"wall_ns", &s->wall_ns},
+        {"layout", &s->layout_ns}, {"bitmap_load", &s->bitmap_ns}, {"allocation", &s->alloc_ns},
+        {"data_copy", &s->copy_ns}, {"metadata_writeback", &s->writeback_ns},
+        {"io_calls", &s->io_calls}, {"bytes_read", &s->bytes_read}, {"bytes_written", &s->bytes_written},
+        {"peak_rss_kib", &s->peak_rss_kib},
+    };
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        if (json_u64(line, keys[k].key, keys[k].field) < 0) return -1;
+    }
+    return 0;
+}
+
+// ====================== Report ======================
+static void report(FILE *out, const char *tool, uint64_t size_kib, uint64_t inodes, const char *dist,
+                   int status, const run_stats_t *s) {
+    double secs = (double)s->wall_ns / 1e9;
+    // The builder stores no files: its rate is image bytes laid out per second, and its
+    // I/O calls are shown in all
+    int builder = strcmp(tool, "mkfs_builder") == 0;
+    double bytes = builder ? (double)size_kib * 1024.0 : (double)s->file_bytes;
+    double ms = 1e-6;
+    fprintf(out, "%-12s %10" PRIu64 " %8" PRIu64 " %-22s %4d %9.1f %9.1f %9.0f %8.2f %9" PRIu64 " %8.1f %8.1f"
+                 "  %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+            tool, size_kib, inodes, dist, status, (double)s->wall_ns * ms,
+            secs > 0 ? bytes / secs / 1e6 : 0.0, secs > 0 ? (double)s->files / secs : 0.0,
+            builder || !s->files ? (double)s->io_calls : (double)s->io_calls / (double)s->files, s->peak_rss_kib,
+            (double)s->bytes_read / 1e6, (double)s->bytes_written / 1e6,
+            (double)s->layout_ns * ms, (double)s->bitmap_ns * ms, (double)s->alloc_ns * ms,
+            (double)s->copy_ns * ms, (double)s->writeback_ns * ms);
+}
+
+static void report_header(FILE *out) {
+    fprintf(out, "%-12s %10s %8s %-22s %4s %9s %9s %9s %8s %9s %8s %8s  %8s %8s %8s %8s %8s\n",
+            "tool", "size_kib", "inodes", "files", "rc", "wall_ms", "MB/s", "files/s", "io/file", "rss_kib", "read_MB", "write_MB",
+            "layout", "bitmaps", "alloc", "copy", "wback");
+}
+
+// Comma-separated list of numbers into out; returns the count, or -1
+static int parse_list(const char *s, uint64_t *out, int max) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        errno = 0;
+        uint64_t v = strtoull(s, &end, 10);
+        if (end == s || errno || v == 0 || n == max) return -1;
+        out[n++] = v;
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        s = end;
+    }
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --size-kib <n[,n...]> --inodes <n[,n...]> --dist <fixed:B|uniform:MIN-MAX|mix:SMALL,LARGE,PCT>... "
+                    "[--files <n>] [--builder <path>] [--adder <path>] [--adder-args \"<args>\"] [--dir <work_dir>] [--out <file>]\n"
+                    "       %s --crc\n", prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t sizes[MAX_SWEEP], inode_counts[MAX_SWEEP];
+    int size_count = 0, inode_count = 0;
+    dist_t dists[MAX_DISTS];
+    int dist_count = 0;
+    int files = 1000;
+    const char *builder = "./mkfs_minivsfs";
+    const char *adder = "./mkfs_adder";
+    char *adder_args = NULL;
+    const char *dir = "bench_work";
+    const char *out_path = NULL;
+    int bad = 0;
+
+    static struct option long_options[] = {
+        {"size-kib", required_argument, 0, 's'},
+        {"inodes", required_argument, 0, 'n'},
+        {"dist", required_argument, 0, 'd'},
+        {"files", required_argument, 0, 'f'},
+        {"builder", required_argument, 0, 'b'},
+        {"adder", required_argument, 0, 'a'},
+        {"adder-args", required_argument, 0, 'A'},
+        {"dir", required_argument, 0, 'w'},
+        {"out", required_argument, 0, 'o'},
+        {"crc", no_argument, 0, 'c'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 's': if ((size_count = parse_list(optarg, sizes, MAX_SWEEP)) < 0) bad = 1; break;
+            case 'n': if ((inode_count = parse_list(optarg, inode_counts, MAX_SWEEP)) < 0) bad = 1; break;
+            case 'd':
+                if (dist_count == MAX_DISTS || parse_dist(optarg, &dists[dist_count]) < 0) bad = 1;
+                else dist_count++;
+                break;
+            case 'f': files = atoi(optarg); break;
+            case 'b': builder = optarg; break;
+            case 'a': adder = optarg; break;
+            case 'A': adder_args = optarg; break;
+            case 'w': dir = optarg; break;
+            case 'o': out_path = optarg; break;
+            case 'c': return run_crc();
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (bad || size_count <= 0 || inode_count <= 0 || dist_count == 0 || files < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Extra adder options (--threads, --io, --dedup, ...) are split on spaces
+    char *extra[MAX_EXTRA_ARGS];
+    int extra_count = 0;
+    for (char *tok = adder_args ? strtok(adder_args, " ") : NULL; tok; tok = strtok(NULL, " ")) {
+        if (extra_count == MAX_EXTRA_ARGS) {
+            fprintf(stderr, "Too many --adder-args\n");
+            return 1;
+        }
+        extra[extra_count++] = tok;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir work directory");
+        return 1;
+    }
+    FILE *out = NULL;
+    if (out_path && !(out = fopen(out_path, "a"))) {
+        perror("open output file");
+        return 1;
+    }
+
+    char manifests[MAX_DISTS][4096];
+    for (int d = 0; d < dist_count; d++) {
+        int64_t total = make_file_set(dir, d, &dists[d], files, manifests[d], sizeof(manifests[d]));
+        if (total < 0) return 1;
+        fprintf(stderr, "File set %d: %d file(s), %" PRId64 " bytes (%s)\n", d, files, total, dists[d].spec);
+    }
+
+    char image[4096 + 16];
+    snprintf(image, sizeof(image), "%s/bench.img", dir);
+    static char output[1u << 16];
+    int failed = 0;
+
+    report_header(stdout);
+    if (out) report_header(out);
+    for (int si = 0; si < size_count; si++) {
+        for (int ni = 0; ni < inode_count; ni++) {
+            char size_arg[32], inodes_arg[32];
+            snprintf(size_arg, sizeof(size_arg), "%" PRIu64, sizes[si]);
+            snprintf(inodes_arg, sizeof(inodes_arg), "%" PRIu64, inode_counts[ni]);
+
+            for (int d = 0; d < dist_count; d++) {
+                // Every ingest starts from a freshly built image
+                char *build_argv[] = { (char*)builder, "--image", image, "--size-kib", size_arg,
+                                       "--inodes", inodes_arg, "--stats=json", NULL };
+                run_stats_t bs;
+                memset(&bs, 0, sizeof(bs));
+                int status = run_tool(build_argv, output, sizeof(output));
+                if (status != 0 || parse_stats(output, &bs) < 0) {
+                    fprintf(stderr, "Builder failed for --size-kib %s --inodes %s (status %d)\n", size_arg, inodes_arg, status);
+                    failed = 1;
+                    continue;
+                }
+                // One builder row per image shape is enough
+                if (d == 0) {
+                    report(stdout, "mkfs_builder", sizes[si], inode_counts[ni], "-", status, &bs);
+                    if (out) report(out, "mkfs_builder", sizes[si], inode_counts[ni], "-", status, &bs);
+                }
+
+                char *add_argv[8 + MAX_EXTRA_ARGS];
+                int k = 0;
+                add_argv[k++] = (char*)adder;
+                add_argv[k++] = "--image";
+                add_argv[k++] = image;
+                add_argv[k++] = "--manifest";
+                add_argv[k++] = manifests[d];
+                add_argv[k++] = "--stats=json";
+                for (int e = 0; e < extra_count; e++) add_argv[k++] = extra[e];
+                add_argv[k] = NULL;
+
+                // The adder exits 1 when it skipped files (a small image fills up), but still
+                // reports what it added
+                run_stats_t as;
+                memset(&as, 0, sizeof(as));
+                status = run_tool(add_argv, output, sizeof(output));
+                if (status < 0 || parse_stats(output, &as) < 0) {
+                    fprintf(stderr, "Adder failed for --size-kib %s --inodes %s, %s (status %d)\n",
+                            size_arg, inodes_arg, dists[d].spec, status);
+                    failed = 1;
+                    continue;
+                }
+                report(stdout, "mkfs_adder", sizes[si], inode_counts[ni], dists[d].spec, status, &as);
+                if (out) report(out, "mkfs_adder", sizes[si], inode_counts[ni], dists[d].spec, status, &as);
+            }
+        }
+    }
+
+    if (out) fclose(out);
+    unlink(image);
+    return failed;
+}
@@ -0,0 +1,546 @@
+#include "expression_simplifier.h"
+
+// Call graph over the function definitions of a program, built from the
+// factor : ID LPAREN argument_list RPAREN sites, and the inlining pass that
+// uses it. Small, non-recursive functions whose body is a single return
+// statement are expanded at their call sites, then the expanded expression is
+// simplified again. A call is left alone when a name the returned expression
+// uses (a global, or a function it calls) is a local or parameter of the
+// caller, which would capture it once pasted there, or when an argument or the
+// returned expression is not already of the declared type the call converts it to,
+// or when an argument with side effects would land where && or || can skip it.
+
+#define INLINE_MAX_COST 16          // tokens in the returned expression
+#define INLINE_SINGLE_CALL_MAX_COST 64
+
+class function_node
+{
+public:
+    string name;
+    string return_type;
+    vector<string> params;
+    vector<string> param_types;
+    map<string, string> locals; // variables declared anywhere in the body -> type
+    string return_expr;         // empty unless the body is a single return statement
+    int size;                   // statements in the body
+    map<string, int> callees;   // callee name -> number of call sites
+    int call_count;             // call sites calling this function
+    int inlined_count;
+
+    function_node()
+    {
+        this->size = 0;
+        this->call_count = 0;
+        this->inlined_count = 0;
+    }
+};
+
+class call_graph
+{
+private:
+    map<string, function_node> functions;
+    map<string, string> globals; // global variable -> type
+    vector<string> definition_order;
+    set<string> flattened;
+    expression_simplifier simplifier;
+    string current_caller;      // function whose text inline_text() is rewriting
+
+    bool reaches(string from, string target, set<string> &seen);
+    bool is_recursive(string name);
+    int inline_cost(string name);
+    bool should_inline(string name, string &reason);
+    void flatten(string name, set<string> &visiting);
+    bool captures(function_node &callee, string caller);
+    string variable_type(string variable, string function);
+    string expression_type(string expr, string function);
+    string inline_text(string text);
+    string expand_call(function_node &callee, vector<string> &args, bool &expanded);
+    string simplify_statement(string line);
+    static vector<string> split_arguments(string text);
+
+public:
+    void add_function(string name, string return_type, vector<pair<string, string>> params, string body);
+    void add_variable(string function, string type, string variable);
+    void add_call(string caller, string callee);
+    string inline_calls(string program, vector<string> &report);
+};
+
+//methods of call_graph class
+
+void call_graph::add_function(string name, string return_type, vector<pair<string, string>> params, string body)
+{
+    function_node &node = functions[name];
+    node.name = name;
+    node.return_type = return_type;
+    node.params.clear();
+    node.param_types.clear();
+    for (auto param : params)
+    {
+        node.param_types.push_back(param.first);
+        node.params.push_back(param.second);
+    }
+
+    node.size = count(body.begin(), body.end(), ';');
+
+    string prefix = "{\nreturn ";
+    string suffix = ";\n}";
+    if (node.size == 1 && body.compare(0, prefix.size(), prefix) == 0 &&
+        body.size() > prefix.size() + suffix.size() &&
+        body.compare(body.size() - suffix.size(), suffix.size(), suffix) == 0)
+    {
+        node.return_expr = body.substr(prefix.size(), body.size() - prefix.size() - suffix.size());
+    }
+
+    definition_order.push_back(name);
+}
+
+void call_graph::add_variable(string function, string type, string variable)
+{
+    // An empty function name is a global
+    if (function.empty())
+    {
+        globals[variable] = type;
+    }
+    else
+    {
+        functions[function].locals[variable] = type;
+    }
+}
+
+void call_graph::add_call(string caller, string callee)
+{
+    functions[caller].callees[callee]++;
+    functions[callee].call_count++;
+}
+
+bool call_graph::reaches(string from, string target, set<string> &seen)
+{
+    for (auto edge : functions[from].callees)
+    {
+        if (edge.first == target)
+            return true;
+        if (seen.insert(edge.first).second && reaches(edge.first, target, seen))
+            return true;
+    }
+    return false;
+}
+
+bool call_graph::is_recursive(string name)
+{
+    set<string> seen;
+    return reaches(name, name, seen);
+}
+
+int call_graph::inline_cost(string name)
+{
+    return expression_simplifier::tokenize(functions[name].return_expr).size();
+}
+
+bool call_graph::should_inline(string name, string &reason)
+{
+    if (functions.find(name) == functions.end() || functions[name].name.empty())
+    {
+        reason = "no definition";
+        return false;
+    }
+
+    function_node &node = functions[name];
+    if (is_recursive(name))
+    {
+        reason = "recursive";
+        return false;
+    }
+    if (node.return_expr.empty())
+    {
+        reason = "body has " + to_string(node.size) + " statements";
+        return false;
+    }
+
+    int limit = node.call_count == 1 ? INLINE_SINGLE_CALL_MAX_COST : INLINE_MAX_COST;
+    if (inline_cost(name) > limit)
+    {
+        reason = "cost " + to_string(inline_cost(name)) + " exceeds " + to_string(limit);
+        return false;
+    }
+
+    // The call converts the returned value to the declared type, the pasted expression would not
+    string type = expression_type(node.return_expr, name);
+    if (type != node.return_type)
+    {
+        reason = "returns " + (type.empty() ? string("an expression of unknown type") : type) + " as " + node.return_type;
+        return false;
+    }
+
+    reason = "cost " + to_string(inline_cost(name));
+    return true;
+}
+
+vector<string> call_graph::split_arguments(string text)
+{
+    vector<string> args;
+    if (text.empty())
+        return args;
+
+    int depth = 0;
+    string current;
+    for (char c : text)
+    {
+        if (c == '(' || c == '[') depth++;
+        if (c == ')' || c == ']') depth--;
+        if (c == ',' && depth == 0)
+        {
+            args.push_back(current);
+            current = "";
+        }
+        else
+        {
+            current += c;
+        }
+    }
+    args.push_back(current);
+    return args;
+}
+
+void call_graph::flatten(string name, set<string> &visiting)
+{
+    // Callees first, so their returned expressions are already expanded
+    if (flattened.count(name) || !visiting.insert(name).second)
+        return;
+
+    for (auto edge : functions[name].callees)
+    {
+        flatten(edge.first, visiting);
+    }
+
+    function_node &node = functions[name];
+    if (!node.return_expr.empty() && !is_recursive(name))
+    {
+        string outer = current_caller;
+        current_caller = name;
+        node.return_expr = inline_text(node.return_expr);
+        current_caller = outer;
+    }
+    flattened.insert(name);
+}
+
+bool call_graph::captures(function_node &callee, string caller)
+{
+    if (caller.empty())
+        return false;
+
+    function_node &scope = functions[caller];
+    for (auto name : expression_simplifier::identifiers(callee.return_expr))
+    {
+        if (find(callee.params.begin(), callee.params.end(), name) != callee.params.end())
+            continue;
+        if (scope.locals.count(name) || find(scope.params.begin(), scope.params.end(), name) != scope.params.end())
+            return true;
+    }
+    return false;
+}
+
+string call_graph::variable_type(string variable, string function)
+{
+    // Parameters, then locals, then globals: the order a use of the name resolves in
+    auto node = functions.find(function);
+    if (node != functions.end())
+    {
+        function_node &scope = node->second;
+        auto param = find(scope.params.begin(), scope.params.end(), variable);
+        if (param != scope.params.end())
+            return scope.param_types[param - scope.params.begin()];
+        if (scope.locals.count(variable))
+            return scope.locals[variable];
+    }
+    return globals.count(variable) ? globals[variable] : "";
+}
+
+string call_graph::expression_type(string expr, string function)
+{
+    // Only expressions whose operands all share one type are typed, so no operator
+    // converts anything; a comparison or logical operator also needs that type to be
+    // int, its result type. Anything else is "", which no declared type matches.
+    vector<string> tokens = expression_simplifier::tokenize(expr);
+    string type;
+    bool logical = false;
+
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        string token = tokens[i];
+        string operand;
+
+        if (isdigit((unsigned char)token[0]) || token[0] == '.')
+        {
+            operand = token.find_first_of(".eE") != string::npos ? "float" : "int";
+        }
+        else if (isalpha((unsigned char)token[0]) || token[0] == '_')
+        {
+            bool call = i + 1 < tokens.size() && tokens[i + 1] == "(";
+            if (call)
+            {
+                auto callee = functions.find(token);
+                operand = callee != functions.end() ? callee->second.return_type : "";
+            }
+            else
+            {
+                operand = variable_type(token, function);
+            }
+
+            // The arguments of a call and the index of an array access do not
+            // contribute to the type of the expression
+            if (i + 1 < tokens.size() && (tokens[i + 1] == "(" || tokens[i + 1] == "["))
+            {
+                string open = tokens[i + 1], close = open == "(" ? ")" : "]";
+                int depth = 0;
+                for (i++; i < tokens.size(); i++)
+                {
+                    if (tokens[i] == open) depth++;
+                    if (tokens[i] == close && --depth == 0) break;
+                }
+            }
+        }
+        else
+        {
+            if (token == "<" || token == ">" || token == "<=" || token == ">=" || token == "==" || token == "!=" ||
+                token == "&&" || token == "||" || token == "!")
+                logical = true;
+            continue;
+        }
+
+        if (operand.empty() || (!type.empty() && operand != type))
+            return "";
+        type = operand;
+    }
+
+    if (logical && type != "int")
+        return "";
+    return type;
+}
+
+string call_graph::expand_call(function_node &callee, vector<string> &args, bool &expanded)
+{
+    expanded = false;
+    if (args.size() != callee.params.size() || captures(callee, current_caller))
+        return "";
+
+    // The call converts each argument to its parameter's type, the pasted text would not
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (expression_type(args[i], current_caller) != callee.param_types[i])
+            return "";
+    }
+
+    vector<string> tokens = expression_simplifier::tokenize(callee.return_expr);
+    for (size_t i = 0; i < callee.params.size(); i++)
+    {
+        int uses = count(tokens.begin(), tokens.end(), callee.params[i]);
+        // An argument is evaluated exactly once by the call; keep it that way
+        if (uses != 1 && !expression_simplifier::is_simple_operand(args[i]))
+            return "";
+    }
+
+    // Everything after &&, || or ? up to the end of its group may be skipped, while the
+    // call always evaluates its arguments: only side-effect free ones may be pasted there
+    vector<bool> skippable(1, false);
+    for (auto token : tokens)
+    {
+        if (token == "(")
+        {
+            skippable.push_back(skippable.back());
+            continue;
+        }
+        if (token == ")" && skippable.size() > 1)
+        {
+            skippable.pop_back();
+            continue;
+        }
+        if (token == "&&" || token == "||" || token == "?")
+        {
+            skippable.back() = true;
+            continue;
+        }
+
+        auto it = find(callee.params.begin(), callee.params.end(), token);
+        if (it != callee.params.end() && skippable.back() &&
+            !expression_simplifier::is_side_effect_free(args[it - callee.params.begin()]))
+            return "";
+    }
+
+    string text;
+    for (auto token : tokens)
+    {
+        auto it = find(callee.params.begin(), callee.params.end(), token);
+        if (it != callee.params.end() && !it->empty())
+        {
+            text += "(" + args[it - callee.params.begin()] + ")";
+        }
+        else
+        {
+            text += token;
+        }
+    }
+
+    expanded = true;
+    text = simplifier.simplify(text);
+    return expression_simplifier::is_simple_operand(text) ? text : "(" + text + ")";
+}
+
+string call_graph::inline_text(string text)
+{
+    string result;
+    size_t i = 0;
+
+    while (i < text.size())
+    {
+        if (!(isalpha((unsigned char)text[i]) || text[i] == '_'))
+        {
+            result += text[i++];
+            continue;
+        }
+
+        size_t j = i;
+        while (j < text.size() && (isalnum((unsigned char)text[j]) || text[j] == '_')) j++;
+        string name = text.substr(i, j - i);
+
+        // A definition header looks like "int name(" and is left alone
+        string before = result.size() >= 1 && result.back() == ' ' ? result.substr(0, result.size() - 1) : "";
+        bool is_header = before.size() >= 3 && (before.compare(before.size() - 3, 3, "int") == 0 ||
+                         (before.size() >= 4 && before.compare(before.size() - 4, 4, "void") == 0) ||
+                         (before.size() >= 5 && before.compare(before.size() - 5, 5, "float") == 0));
+
+        if (is_header && j < text.size() && text[j] == '(')
+        {
+            current_caller = name;
+        }
+
+        string reason;
+        if (j >= text.size() || text[j] != '(' || is_header || !should_inline(name, reason))
+        {
+            result += name;
+            i = j;
+            continue;
+        }
+
+        int depth = 0;
+        size_t k = j;
+        for (; k < text.size(); k++)
+        {
+            if (text[k] == '(') depth++;
+            if (text[k] == ')' && --depth == 0) break;
+        }
+
+        vector<string> args = split_arguments(text.substr(j + 1, k - j - 1));
+        for (auto &arg : args)
+        {
+            arg = inline_text(arg);
+        }
+
+        bool expanded;
+        string replacement = expand_call(functions[name], args, expanded);
+        if (expanded)
+        {
+            functions[name].inlined_count++;
+            result += replacement;
+        }
+        else
+        {
+            string joined;
+            for (size_t a = 0; a < args.size(); a++)
+            {
+                joined += (a > 0 ? "," : "") + args[a];
+            }
+            result += name + "(" + joined + ")";
+        }
+        i = k + 1;
+    }
+
+    return result;
+}
+
+string call_graph::simplify_statement(string line)
+{
+    // Only expression statements and returns; conditions and loop headers stay as they are
+    if (line.size() < 2 || line.back() != ';')
+        return line;
+
+    string body = line.substr(0, line.size() - 1);
+    if (body.compare(0, 7, "return ") == 0)
+    {
+        return "return " + simplifier.simplify(body.substr(7)) + ";";
+    }
+
+    int depth = 0;
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        if (body[i] == '(' || body[i] == '[') depth++;
+        if (body[i] == ')' || body[i] == ']') depth--;
+        if (body[i] == '=' && depth == 0)
+        {
+            if (i + 1 < body.size() && body[i + 1] == '=')
+                break; // first top-level operator is a comparison, not an assignment
+            if (i > 0 && (body[i - 1] == '<' || body[i - 1] == '>' || body[i - 1] == '!'))
+                break;
+            return body.substr(0, i + 1) + simplifier.simplify(body.substr(i + 1)) + ";";
+        }
+    }
+
+    if (body.find_first_of("{}") != string::npos || body.find("printf(") == 0)
+        return line;
+    return simplifier.simplify(body) + ";";
+}
+
+string call_graph::inline_calls(string program, vector<string> &report)
+{
+    for (auto name : definition_order)
+    {
+        for (auto edge : functions[name].callees)
+        {
+            report.push_back("Call graph: " + name + " -> " + edge.first + " (" + to_string(edge.second) + " call sites)");
+        }
+    }
+
+    set<string> visiting;
+    for (auto name : definition_order)
+    {
+        flatten(name, visiting);
+    }
+
+    // Sites inside inlined bodies were counted while flattening, count only the program's own
+    for (auto &entry : functions)
+    {
+        entry.second.inlined_count = 0;
+    }
+    current_caller = "";
+    string result = inline_text(program);
+
+    // Inlining never adds or removes lines, so the rewritten statements line up with the originals
+    istringstream before(program), after(result);
+    string old_line, new_line, simplified;
+    bool first = true;
+    while (getline(before, old_line) && getline(after, new_line))
+    {
+        simplified += (first ? "" : "\n") + (old_line == new_line ? new_line : simplify_statement(new_line));
+        first = false;
+    }
+    result = simplified;
+
+    for (auto name : definition_order)
+    {
+        string reason;
+        function_node &node = functions[name];
+        if (node.call_count == 0)
+            continue;
+
+        if (should_inline(name, reason))
+        {
+            report.push_back("Inlined " + to_string(node.inlined_count) + " of " + to_string(node.call_count) +
+                             " call sites of " + name + " (" + reason + ")");
+        }
+        else
+        {
+            report.push_back("Not inlined " + name + ": " + reason);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Differential test of the SIMD scanner against flex: scans scanner_check.c with both,
+# once with the SSE2 paths and once with the AVX2 ones, and fails unless --check-scanner
+# finds the same tokens, line counts and echoed text.
+
+set -e
+
+yacc -d -y 22301258.y
+g++ -w -c -o y.o y.tab.c
+flex 22301258.l
+echo 'Generated the parser and scanner C files'
+
+for isa in sse2 avx2
+do
+	g++ -fpermissive -w -m$isa -c -o l.o lex.yy.c
+	g++ -pthread -o scanner_check y.o l.o
+	# Unmatched bytes are echoed to stdout first, without a newline
+	result=$(./scanner_check --check-scanner scanner_check.c | grep -o 'Scanner check.*')
+	echo "$isa: $result"
+	case "$result" in
+		"Scanner check passed"*) ;;
+		*) exit 1 ;;
+	esac
+done
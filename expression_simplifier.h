@@ -0,0 +1,436 @@
+#ifndef EXPRESSION_SIMPLIFIER_H
+#define EXPRESSION_SIMPLIFIER_H
+
+#include<bits/stdc++.h>
+using namespace std;
+
+// Local simplification of expression text as the parser prints it: integer
+// constant folding, algebraic identities and removal of redundant parentheses.
+// Expressions with calls, assignments or ++/-- are never dropped or duplicated.
+
+class expr_node
+{
+public:
+    string op;              // operator, or "" for a leaf
+    string text;            // leaf text (identifier, constant, call, array access, x++)
+    vector<expr_node *> kids;
+
+    expr_node(string op, string text)
+    {
+        this->op = op;
+        this->text = text;
+    }
+
+    ~expr_node()
+    {
+        for (auto kid : kids)
+        {
+            delete kid;
+        }
+    }
+};
+
+class expression_simplifier
+{
+private:
+    vector<string> tokens;
+    size_t pos;
+
+    expr_node *parse_logic();
+    expr_node *parse_rel();
+    expr_node *parse_add();
+    expr_node *parse_mul();
+    expr_node *parse_unary();
+    expr_node *parse_primary();
+    string take_group(string open, string close);
+
+    expr_node *fold(expr_node *node);
+    string print(expr_node *node, int parent_prec, bool right_side);
+
+    static int precedence(string op);
+    static bool is_int_constant(expr_node *node, long long &value);
+    static bool has_side_effects(expr_node *node);
+
+public:
+    static vector<string> tokenize(string expr);
+    static set<string> identifiers(string expr);
+    static bool is_simple_operand(string expr);
+    static bool is_side_effect_free(string expr);
+    string simplify(string expr);
+};
+
+//methods of expression_simplifier class
+
+vector<string> expression_simplifier::tokenize(string expr)
+{
+    vector<string> result;
+    size_t i = 0;
+
+    while (i < expr.size())
+    {
+        char c = expr[i];
+
+        if (isspace((unsigned char)c))
+        {
+            i++;
+        }
+        else if (isalpha((unsigned char)c) || c == '_')
+        {
+            size_t j = i;
+            while (j < expr.size() && (isalnum((unsigned char)expr[j]) || expr[j] == '_')) j++;
+            result.push_back(expr.substr(i, j - i));
+            i = j;
+        }
+        else if (isdigit((unsigned char)c) || c == '.')
+        {
+            size_t j = i;
+            while (j < expr.size() && (isalnum((unsigned char)expr[j]) || expr[j] == '.' ||
+                   ((expr[j] == '-') && (expr[j - 1] == 'e' || expr[j - 1] == 'E')))) j++;
+            result.push_back(expr.substr(i, j - i));
+            i = j;
+        }
+        else
+        {
+            string two = expr.substr(i, 2);
+            if (two == "++" || two == "--" || two == "<=" || two == ">=" || two == "==" ||
+                two == "!=" || two == "&&" || two == "||")
+            {
+                result.push_back(two);
+                i += 2;
+            }
+            else
+            {
+                result.push_back(string(1, c));
+                i++;
+            }
+        }
+    }
+
+    return result;
+}
+
+set<string> expression_simplifier::identifiers(string expr)
+{
+    set<string> names;
+    for (auto token : tokenize(expr))
+    {
+        if (isalpha((unsigned char)token[0]) || token[0] == '_')
+        {
+            names.insert(token);
+        }
+    }
+    return names;
+}
+
+bool expression_simplifier::is_simple_operand(string expr)
+{
+    vector<string> parts = tokenize(expr);
+    return parts.size() == 1 && parts[0] != "++" && parts[0] != "--";
+}
+
+bool expression_simplifier::is_side_effect_free(string expr)
+{
+    // The same test has_side_effects() makes on a tree: no call, assignment, ++ or --
+    vector<string> parts = tokenize(expr);
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        if (parts[i] == "++" || parts[i] == "--" || parts[i] == "=")
+            return false;
+        if ((isalpha((unsigned char)parts[i][0]) || parts[i][0] == '_') && i + 1 < parts.size() && parts[i + 1] == "(")
+            return false;
+    }
+    return true;
+}
+
+int expression_simplifier::precedence(string op)
+{
+    if (op == "||" || op == "&&") return 1;
+    if (op == "<" || op == ">" || op == "<=" || op == ">=" || op == "==" || op == "!=") return 2;
+    if (op == "+" || op == "-") return 3;
+    if (op == "*" || op == "/" || op == "%") return 4;
+    if (op == "neg" || op == "pos" || op == "!") return 5;
+    return 6; // leaf
+}
+
+string expression_simplifier::take_group(string open, string close)
+{
+    // Copies a balanced (...) or [...] group verbatim, including the brackets
+    string text;
+    int depth = 0;
+    while (pos < tokens.size())
+    {
+        string token = tokens[pos++];
+        if (token == open) depth++;
+        if (token == close) depth--;
+        text += token;
+        if (depth == 0) break;
+    }
+    return text;
+}
+
+expr_node *expression_simplifier::parse_logic()
+{
+    expr_node *left = parse_rel();
+    // The grammar allows a single LOGICOP per logic_expression
+    if (pos < tokens.size() && (tokens[pos] == "&&" || tokens[pos] == "||"))
+    {
+        expr_node *node = new expr_node(tokens[pos++], "");
+        node->kids.push_back(left);
+        node->kids.push_back(parse_rel());
+        return node;
+    }
+    return left;
+}
+
+expr_node *expression_simplifier::parse_rel()
+{
+    expr_node *left = parse_add();
+    if (pos < tokens.size() && precedence(tokens[pos]) == 2)
+    {
+        expr_node *node = new expr_node(tokens[pos++], "");
+        node->kids.push_back(left);
+        node->kids.push_back(parse_add());
+        return node;
+    }
+    return left;
+}
+
+expr_node *expression_simplifier::parse_add()
+{
+    expr_node *left = parse_mul();
+    while (pos < tokens.size() && (tokens[pos] == "+" || tokens[pos] == "-"))
+    {
+        expr_node *node = new expr_node(tokens[pos++], "");
+        node->kids.push_back(left);
+        node->kids.push_back(parse_mul());
+        left = node;
+    }
+    return left;
+}
+
+expr_node *expression_simplifier::parse_mul()
+{
+    expr_node *left = parse_unary();
+    while (pos < tokens.size() && (tokens[pos] == "*" || tokens[pos] == "/" || tokens[pos] == "%"))
+    {
+        expr_node *node = new expr_node(tokens[pos++], "");
+        node->kids.push_back(left);
+        node->kids.push_back(parse_unary());
+        left = node;
+    }
+    return left;
+}
+
+expr_node *expression_simplifier::parse_unary()
+{
+    if (pos < tokens.size() && (tokens[pos] == "-" || tokens[pos] == "+" || tokens[pos] == "!"))
+    {
+        string token = tokens[pos++];
+        expr_node *node = new expr_node(token == "-" ? "neg" : (token == "+" ? "pos" : "!"), "");
+        node->kids.push_back(parse_unary());
+        return node;
+    }
+    return parse_primary();
+}
+
+expr_node *expression_simplifier::parse_primary()
+{
+    if (pos >= tokens.size())
+    {
+        return new expr_node("", "");
+    }
+
+    if (tokens[pos] == "(")
+    {
+        pos++;
+        expr_node *inner = parse_logic();
+        if (pos < tokens.size() && tokens[pos] == ")") pos++;
+        return inner;
+    }
+
+    string text = tokens[pos++];
+    if (pos < tokens.size() && tokens[pos] == "(")
+    {
+        text += take_group("(", ")");
+    }
+    else if (pos < tokens.size() && tokens[pos] == "[")
+    {
+        text += take_group("[", "]");
+    }
+    if (pos < tokens.size() && (tokens[pos] == "++" || tokens[pos] == "--"))
+    {
+        text += tokens[pos++];
+    }
+    return new expr_node("", text);
+}
+
+bool expression_simplifier::is_int_constant(expr_node *node, long long &value)
+{
+    if (!node->op.empty() || node->text.empty())
+        return false;
+
+    for (char c : node->text)
+    {
+        if (!isdigit((unsigned char)c))
+            return false;
+    }
+    if (node->text.size() > 9)
+        return false;
+
+    value = stoll(node->text);
+    return true;
+}
+
+bool expression_simplifier::has_side_effects(expr_node *node)
+{
+    if (node->op.empty())
+    {
+        return node->text.find('(') != string::npos || node->text.find("++") != string::npos ||
+               node->text.find("--") != string::npos || node->text.find('=') != string::npos;
+    }
+    for (auto kid : node->kids)
+    {
+        if (has_side_effects(kid))
+            return true;
+    }
+    return false;
+}
+
+expr_node *expression_simplifier::fold(expr_node *node)
+{
+    for (auto &kid : node->kids)
+    {
+        kid = fold(kid);
+    }
+
+    long long a, b;
+    if (node->kids.size() == 1 && is_int_constant(node->kids[0], a))
+    {
+        long long result;
+        if (node->op == "neg") result = -a;
+        else if (node->op == "!") result = !a;
+        else result = a;
+
+        if (result >= 0)
+        {
+            delete node;
+            return new expr_node("", to_string(result));
+        }
+        return node;
+    }
+
+    if (node->kids.size() != 2)
+        return node;
+
+    bool left_const = is_int_constant(node->kids[0], a);
+    bool right_const = is_int_constant(node->kids[1], b);
+    string op = node->op;
+
+    if (left_const && right_const)
+    {
+        long long result;
+        bool folded = true;
+        if (op == "+") result = a + b;
+        else if (op == "-") result = a - b;
+        else if (op == "*") result = a * b;
+        else if (op == "/" && b != 0) result = a / b;
+        else if (op == "%" && b != 0) result = a % b;
+        else if (op == "<") result = a < b;
+        else if (op == ">") result = a > b;
+        else if (op == "<=") result = a <= b;
+        else if (op == ">=") result = a >= b;
+        else if (op == "==") result = a == b;
+        else if (op == "!=") result = a != b;
+        else if (op == "&&") result = a && b;
+        else if (op == "||") result = a || b;
+        else folded = false;
+
+        // Negative results would need a unary minus in the text, keep them as they are
+        if (folded && result >= 0 && result <= INT_MAX)
+        {
+            delete node;
+            return new expr_node("", to_string(result));
+        }
+        return node;
+    }
+
+    // x+0, 0+x, x-0, x*1, 1*x, x/1 and, for side-effect free x, x*0 and 0*x
+    int keep = -1;
+    if (op == "+" && right_const && b == 0) keep = 0;
+    else if (op == "+" && left_const && a == 0) keep = 1;
+    else if (op == "-" && right_const && b == 0) keep = 0;
+    else if ((op == "*" || op == "/") && right_const && b == 1) keep = 0;
+    else if (op == "*" && left_const && a == 1) keep = 1;
+
+    if (keep != -1)
+    {
+        expr_node *kept = node->kids[keep];
+        node->kids[keep] = NULL;
+        node->kids.erase(remove(node->kids.begin(), node->kids.end(), (expr_node *)NULL), node->kids.end());
+        delete node;
+        return kept;
+    }
+
+    if (op == "*" && ((right_const && b == 0 && !has_side_effects(node->kids[0])) ||
+                      (left_const && a == 0 && !has_side_effects(node->kids[1]))))
+    {
+        delete node;
+        return new expr_node("", "0");
+    }
+
+    return node;
+}
+
+string expression_simplifier::print(expr_node *node, int parent_prec, bool right_side)
+{
+    if (node->op.empty())
+    {
+        return node->text;
+    }
+
+    int prec = precedence(node->op);
+    string text;
+
+    if (node->kids.size() == 1)
+    {
+        string sign = node->op == "neg" ? "-" : (node->op == "pos" ? "+" : "!");
+        string operand = print(node->kids[0], prec, true);
+        if (operand[0] == '-' || operand[0] == '+')
+        {
+            operand = "(" + operand + ")"; // -(-x) must not print as the DECOP --x
+        }
+        text = sign + operand;
+    }
+    else
+    {
+        text = print(node->kids[0], prec, false) + node->op + print(node->kids[1], prec, true);
+    }
+
+    // Right operands of the same level keep their parentheses: a-(b-c) is not a-b-c
+    if (prec < parent_prec || (prec == parent_prec && right_side && prec != 5))
+    {
+        text = "(" + text + ")";
+    }
+    return text;
+}
+
+string expression_simplifier::simplify(string expr)
+{
+    tokens = tokenize(expr);
+    pos = 0;
+
+    expr_node *root = parse_logic();
+    if (pos != tokens.size())
+    {
+        // Not an expression this simplifier understands, leave it untouched
+        delete root;
+        return expr;
+    }
+
+    root = fold(root);
+    string text = print(root, 0, false);
+    delete root;
+    return text;
+}
+
+#endif
@@ -0,0 +1,299 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread extract_minivsfs.c minivsfs.c -o extract_minivsfs
+// Copies files out of a MiniVSFS image. A name is resolved through the root directory's
+// index; the inode's blocks come back from mvfs_file_runs() with adjacent blocks already
+// merged, so a file laid out contiguously is one large copy however it is described.
+// Runs are copied with copy_file_range, or written straight from the mapping when the
+// kernel refuses, and never past size_bytes; a compressed file is decompressed a chunk at
+// a time as it is written. --all extracts every file in the root directory with a pool
+// of workers.
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "minivsfs.h"
+
+#define MAX_THREADS 64
+
+static _Atomic int use_copy_file_range = 1;     // cleared the first time the kernel or filesystem refuses it
+
+// Copies `len` image bytes at `off` to out_fd at *out_off. Returns 0, or -1 with a message.
+static int copy_out(mvfs_t *fs, int out_fd, uint64_t off, uint64_t len, uint64_t *out_off) {
+    while (len > 0 && use_copy_file_range) {
+        loff_t in = (loff_t)off, out = (loff_t)*out_off;
+        size_t want = len > (1u << 30) ? (1u << 30) : (size_t)len;
+        ssize_t n = copy_file_range(fs->fd, &in, out_fd, &out, want, 0);
+        if (n > 0) {
+            off += (uint64_t)n;
+            *out_off += (uint64_t)n;
+            len -= (uint64_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+            use_copy_file_range = 0;
+            break;
+        }
+        perror("copy file data");
+        return -1;
+    }
+
+    // The image is mapped: write the bytes from there, no read or bounce buffer needed
+    while (len > 0) {
+        ssize_t n = pwrite(out_fd, mvfs_block(fs, 0) + off, len > (1u << 30) ? (1u << 30) : (size_t)len, (off_t)*out_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("write output file");
+            return -1;
+        }
+        off += (uint64_t)n;
+        *out_off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint64_t off;
+} plain_out_t;
+
+// mvfs_file_decompress() callback: appends a chunk of plain bytes to the output file
+static int write_plain(const uint8_t *data, size_t len, void *ctx) {
+    plain_out_t *out = (plain_out_t*)ctx;
+    while (len > 0) {
+        ssize_t n = pwrite(out->fd, data, len, (off_t)out->off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("write output file");
+            return 1;
+        }
+        data += n;
+        len -= (size_t)n;
+        out->off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Writes inode `ino` to `path` (relative to dir_fd). Returns 0, or 1 with a message.
+static int extract_inode(mvfs_t *fs, uint32_t ino, int dir_fd, const char *path, const char *name) {
+    const inode_t *in = mvfs_inode(fs, ino);
+    if (!inode_crc_ok(in)) {
+        fprintf(stderr, "'%s' has a corrupt inode (inode %u)\n", name, ino);
+        return 1;
+    }
+    if ((in->mode & 0170000) != 0100000) {
+        fprintf(stderr, "'%s' is not a regular file (inode %u)\n", name, ino);
+        return 1;
+    }
+
+    // A packed file is one piece of a shared fragment block: a single run of bytes
+    static __thread mvfs_run_t runs[EXTENT_MAX];
+    const uint8_t *tail = mvfs_is_packed(in) ? mvfs_packed_tail(fs, in) : NULL;
+    int count = mvfs_is_packed(in) ? (tail ? 0 : -1) : mvfs_file_runs(fs, in, runs, EXTENT_MAX);
+    int compressed = mvfs_is_compressed(in);
+    if (count < 0) {
+        fprintf(stderr, "'%s' has a corrupt block map (inode %u)\n", name, ino);
+        return 1;
+    }
+
+    // Start reading every run now; the copies (or decompression) below then find them in the page cache
+    for (int k = 0; k < count; k++) {
+        posix_fadvise(fs->fd, (off_t)(runs[k].start * BS), (off_t)(runs[k].len * BS), POSIX_FADV_WILLNEED);
+    }
+
+    int out_fd = openat(dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("open output file");
+        return 1;
+    }
+
+    // Only the last run can hold bytes past the end of the file
+    uint64_t left = in->size_bytes;
+    uint64_t out_off = 0;
+    int rc = 0;
+    if (compressed) {
+        plain_out_t plain = { out_fd, 0 };
+        rc = mvfs_file_decompress(fs, in, write_plain, &plain);
+        if (rc < 0) fprintf(stderr, "'%s' has a corrupt compressed stream (inode %u)\n", name, ino);
+        count = 0;
+    }
+    if (tail) rc = copy_out(fs, out_fd, (uint64_t)(tail - mvfs_block(fs, 0)), left, &out_off);
+    for (int k = 0; k < count && left > 0 && rc == 0; k++) {
+        uint64_t bytes = runs[k].len * BS < left ? runs[k].len * BS : left;
+        rc = copy_out(fs, out_fd, runs[k].start * BS, bytes, &out_off);
+        left -= bytes;
+    }
+    if (close(out_fd) < 0 && rc == 0) {
+        perror("close output file");
+        rc = -1;
+    }
+    if (rc != 0) return 1;
+
+    printf("File '%s' extracted to '%s' (%" PRIu64 " bytes)\n", name, path, in->size_bytes);
+    return 0;
+}
+
+// ====================== Bulk extraction ======================
+typedef struct {
+    uint32_t ino;
+    char name[58];
+} entry_t;
+
+typedef struct {
+    mvfs_t *fs;
+    int dir_fd;
+    entry_t *entries;
+    size_t count, cap;
+    _Atomic size_t next;
+    _Atomic int extracted;
+    _Atomic int failed;
+} bulk_t;
+
+static int collect_entry(const dirent64_t *de, void *ctx) {
+    bulk_t *b = (bulk_t*)ctx;
+    if (de->type != 1) return 0;    // '.', '..' and any subdirectory
+    if (b->count == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 256;
+        entry_t *grown = realloc(b->entries, b->cap * sizeof(entry_t));
+        if (!grown) { perror("realloc entry list"); return -1; }
+        b->entries = grown;
+    }
+    entry_t *e = &b->entries[b->count++];
+    e->ino = de->inode_no;
+    memcpy(e->name, de->name, sizeof(e->name));
+    e->name[sizeof(e->name) - 1] = '\0';
+    return 0;
+}
+
+static void *bulk_worker(void *arg) {
+    bulk_t *b = (bulk_t*)arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&b->next, 1);
+        if (i >= b->count) break;
+        entry_t *e = &b->entries[i];
+
+        // Names come from the image: nothing that could leave the output directory
+        if (e->name[0] == '\0' || strchr(e->name, '/') || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+            fprintf(stderr, "Skipping unsafe name '%s' (inode %u)\n", e->name, e->ino);
+            atomic_fetch_add(&b->failed, 1);
+            continue;
+        }
+        if (extract_inode(b->fs, e->ino, b->dir_fd, e->name, e->name) == 0) atomic_fetch_add(&b->extracted, 1);
+        else atomic_fetch_add(&b->failed, 1);
+    }
+    return NULL;
+}
+
+// Extracts every file in the root directory into out_dir. Returns the number that failed,
+// or -1 if the directory could not be read.
+static int extract_all(mvfs_t *fs, const char *out_dir, int threads, int *extracted) {
+    if (mkdir(out_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir output directory");
+        return -1;
+    }
+    bulk_t b;
+    memset(&b, 0, sizeof(b));
+    b.fs = fs;
+    b.dir_fd = open(out_dir, O_RDONLY | O_DIRECTORY);
+    if (b.dir_fd < 0) {
+        perror("open output directory");
+        return -1;
+    }
+
+    if (mvfs_dir_foreach(fs, mvfs_inode(fs, ROOT_INO), collect_entry, &b) != 0) {
+        fprintf(stderr, "Root directory is corrupt\n");
+        free(b.entries);
+        close(b.dir_fd);
+        return -1;
+    }
+    atomic_init(&b.next, 0);
+    atomic_init(&b.extracted, 0);
+    atomic_init(&b.failed, 0);
+
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; ++t) {
+        if (pthread_create(&tids[started], NULL, bulk_worker, &b) != 0) break;
+        started++;
+    }
+    bulk_worker(&b);
+    for (int t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+
+    free(b.entries);
+    close(b.dir_fd);
+    *extracted = atomic_load(&b.extracted);
+    return atomic_load(&b.failed);
+}
+
+int main(int argc, char *argv[]) {
+    char *image_file = NULL;
+    char *name = NULL;
+    char *out = NULL;
+    int all = 0;
+    int threads = 1;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"name", required_argument, 0, 'n'},
+        {"out", required_argument, 0, 'o'},
+        {"all", no_argument, 0, 'a'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'i': image_file = optarg; break;
+            case 'n': name = optarg; break;
+            case 'o': out = optarg; break;
+            case 'a': all = 1; break;
+            case 't': threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s --image <fs_image> (--name <name_in_fs> --out <file> | --all --out <dir> [--threads <n>])\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (!image_file || !out || (all ? name != NULL : name == NULL) || threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s --image <fs_image> (--name <name_in_fs> --out <file> | --all --out <dir> [--threads <n>])\n", argv[0]);
+        return 1;
+    }
+
+    mvfs_init();
+
+    mvfs_t fs;
+    if (mvfs_open(&fs, image_file, 0) < 0) {
+        return 1;
+    }
+
+    int rc;
+    if (all) {
+        int extracted = 0;
+        int failed = extract_all(&fs, out, threads, &extracted);
+        if (failed >= 0) printf("Extracted %d file(s) to '%s', %d failed\n", extracted, out, failed);
+        rc = failed == 0 ? 0 : 1;
+    } else {
+        dirent64_t *de = mvfs_dir_lookup(&fs, mvfs_inode(&fs, ROOT_INO), name);
+        if (!de) {
+            fprintf(stderr, "File '%s' not found\n", name);
+            rc = 1;
+        } else {
+            rc = extract_inode(&fs, de->inode_no, AT_FDCWD, out, name);
+        }
+    }
+
+    mvfs_close(&fs);
+    return rc;
+}
@@ -0,0 +1,664 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread fsck_minivsfs.c minivsfs.c -o fsck_minivsfs
+// Read-only consistency check of a MiniVSFS image. Workers take slices of the inode
+// tables and check each inode's CRC, its bitmap bit, and the blocks it owns (directories
+// with their index and dirent checksums); every referenced block is claimed in a shared
+// bitmap with one atomic OR, which finds double allocations on the spot. The main thread
+// then compares that bitmap with the data bitmaps, the directory references with the
+// link counts, the packed files' fragments with each other, and the references to each
+// shared block with its count in the shared-block table. Only metadata is read, so the time
+// depends on the inode count, not on the size of the file data.
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "minivsfs.h"
+
+#define MAX_THREADS 64
+#define SLICE_INODES 8192u    // inodes per work item (64 inode-table blocks)
+#define MAX_LISTED 10         // problems printed per check; the rest are only counted
+
+// fsck(8) exit codes
+#define EXIT_CLEAN 0
+#define EXIT_UNCORRECTED 4
+#define EXIT_OPERATIONAL 8
+#define EXIT_USAGE 16
+
+enum {
+    CHECK_SUPERBLOCK,
+    CHECK_GROUPS,
+    CHECK_INODE_CRC,
+    CHECK_INODE_BITMAP,
+    CHECK_FILES,
+    CHECK_DIRS,
+    CHECK_DIRENTS,
+    CHECK_BLOCKS,
+    CHECK_DATA_BITMAP,
+    CHECK_LINKS,
+    CHECK_COUNT
+};
+
+static const char *check_names[CHECK_COUNT] = {
+    "superblock", "group descriptors", "inode CRCs", "inode bitmap", "file block maps",
+    "directory structure", "dirent checksums", "block ownership", "data bitmap", "link counts",
+};
+
+enum { INODE_FREE, INODE_FILE, INODE_DIR, INODE_BAD };
+
+typedef struct {
+    int check;
+    uint64_t subject;           // inode or block number the message is about
+    char text[112];
+} problem_t;
+
+// One packed file's bytes, or with ino 0 the free end of the open fragment block
+typedef struct {
+    uint64_t block;
+    uint32_t offset, len;
+    uint32_t ino;
+} fragment_t;
+
+typedef struct {
+    mvfs_t *fs;
+    uint64_t slices_per_group;
+    uint64_t slice_count;
+    _Atomic uint64_t next_slice;
+
+    uint64_t *seen;             // one bit per image block, set by the first reference
+    uint64_t *shared;           // one bit per image block, set for fragment blocks
+    fragment_t *fragments;      // with packed tails: one per packed file, and the open block
+    _Atomic uint64_t fragment_count;
+    shared_ref_t *shared_refs;  // the shared-block table, in block order
+    uint64_t shared_count;
+    _Atomic uint32_t *shared_claims;    // references found to each of them
+    _Atomic uint32_t *refs;     // directory entries naming each inode, by inode number
+    uint8_t *state;             // INODE_*, by inode number
+
+    _Atomic uint64_t checked[CHECK_COUNT];
+    _Atomic uint64_t found[CHECK_COUNT];
+    _Atomic uint64_t inodes_used;
+    _Atomic uint64_t blocks_used;
+
+    pthread_mutex_t lock;       // guards the list below
+    problem_t *listed;
+    size_t listed_count;
+    uint32_t listed_per_check[CHECK_COUNT];
+} fsck_t;
+
+static void report(fsck_t *ck, int check, uint64_t subject, const char *fmt, ...) {
+    atomic_fetch_add(&ck->found[check], 1);
+
+    pthread_mutex_lock(&ck->lock);
+    if (ck->listed_per_check[check] < MAX_LISTED) {
+        problem_t *p = &ck->listed[ck->listed_count++];
+        p->check = check;
+        p->subject = subject;
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(p->text, sizeof(p->text), fmt, ap);
+        va_end(ap);
+        ck->listed_per_check[check]++;
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+static int cmp_shared_ref(const void *a, const void *b) {
+    uint64_t x = ((const shared_ref_t*)a)->block, y = ((const shared_ref_t*)b)->block;
+    return x < y ? -1 : (x > y);
+}
+
+// Claims `block` for one owner. Returns 0 if it is outside every data region or already
+// claimed (and reports which), 1 otherwise. A block in the shared-block table may be
+// claimed any number of times; the claims are counted and compared in check_shared().
+static int claim_block(fsck_t *ck, uint64_t block, uint32_t ino, const char *what) {
+    atomic_fetch_add(&ck->checked[CHECK_BLOCKS], 1);
+    if (!mvfs_data_group(ck->fs, block)) {
+        report(ck, CHECK_BLOCKS, ino, "inode %u: %s block %" PRIu64 " is outside the data regions", ino, what, block);
+        return 0;
+    }
+    uint64_t bit = 1ull << (block & 63u);
+    if (ck->shared_count) {
+        shared_ref_t key = { .block = block };
+        const shared_ref_t *e = bsearch(&key, ck->shared_refs, ck->shared_count, sizeof(shared_ref_t), cmp_shared_ref);
+        if (e) {
+            if (atomic_fetch_add(&ck->shared_claims[e - ck->shared_refs], 1) == 0) {
+                __atomic_fetch_or(&ck->seen[block >> 6], bit, __ATOMIC_RELAXED);
+                atomic_fetch_add(&ck->blocks_used, 1);
+            }
+            return 1;
+        }
+    }
+    uint64_t old = __atomic_fetch_or(&ck->seen[block >> 6], bit, __ATOMIC_RELAXED);
+    if (old & bit) {
+        report(ck, CHECK_BLOCKS, block, "block %" PRIu64 ": claimed again by inode %u (%s)", block, ino, what);
+        return 0;
+    }
+    atomic_fetch_add(&ck->blocks_used, 1);
+    return 1;
+}
+
+// Claims `block` as a fragment block, which any number of packed files may share; the
+// first of them claims it for all. Their bytes are compared in check_fragments().
+static void claim_fragment(fsck_t *ck, uint64_t block, uint32_t offset, uint32_t len, uint32_t ino) {
+    uint64_t bit = 1ull << (block & 63u);
+    if (!mvfs_data_group(ck->fs, block) ||
+        (!(__atomic_fetch_or(&ck->shared[block >> 6], bit, __ATOMIC_RELAXED) & bit) &&
+         !claim_block(ck, block, ino, "fragment"))) {
+        return;
+    }
+    fragment_t *f = &ck->fragments[atomic_fetch_add(&ck->fragment_count, 1)];
+    f->block = block;
+    f->offset = offset;
+    f->len = len;
+    f->ino = ino;
+}
+
+// ====================== Files ======================
+static void check_packed(fsck_t *ck, uint32_t ino, const inode_t *in) {
+    if (!ck->fragments || in->size_bytes == 0 || !mvfs_packed_tail(ck->fs, in)) {
+        report(ck, CHECK_FILES, ino, "inode %u: bad packed tail (%" PRIu64 " bytes at %u in block %u)",
+               ino, in->size_bytes, in->reserved_0, in->reserved_1);
+        return;
+    }
+    atomic_fetch_add(&ck->checked[CHECK_BLOCKS], 1);
+    claim_fragment(ck, in->reserved_1, in->reserved_0, (uint32_t)in->size_bytes, ino);
+}
+
+// A compressed file's extents, already claimed, hold `total` blocks: its stream header
+// must describe exactly that many (the chunks themselves are not decompressed)
+static void check_compressed(fsck_t *ck, uint32_t ino, const inode_t *in, uint64_t total) {
+    static __thread mvfs_run_t runs[EXTENT_MAX];
+    int count = total < div_round_up_u64(in->size_bytes, BS) ? mvfs_file_runs(ck->fs, in, runs, EXTENT_MAX) : -1;
+    compress_header_t *h = count > 0 ? mvfs_compress_header(ck->fs, in, runs, count) : NULL;
+    if (!h) {
+        report(ck, CHECK_FILES, ino, "inode %u: bad compressed stream (%" PRIu64 " bytes in %" PRIu64 " blocks)",
+               ino, in->size_bytes, total);
+    }
+    free(h);
+}
+
+static void check_file(fsck_t *ck, uint32_t ino, const inode_t *in) {
+    mvfs_t *fs = ck->fs;
+    uint64_t blocks = div_round_up_u64(in->size_bytes, BS);
+    atomic_fetch_add(&ck->checked[CHECK_FILES], 1);
+
+    if (mvfs_is_packed(in)) {
+        check_packed(ck, ino, in);
+        return;
+    }
+
+    if (!(in->reserved_2 & INODE_FLAG_EXTENTS)) {
+        if (mvfs_is_compressed(in)) {
+            report(ck, CHECK_FILES, ino, "inode %u: compressed without extents", ino);
+            return;
+        }
+        if (blocks > DIRECT_MAX) {
+            report(ck, CHECK_FILES, ino, "inode %u: %" PRIu64 " bytes do not fit in direct blocks", ino, in->size_bytes);
+            return;
+        }
+        for (uint64_t i = 0; i < blocks; i++) claim_block(ck, in->direct[i], ino, "data");
+        return;
+    }
+
+    uint32_t count = in->reserved_0;
+    if (count > EXTENT_MAX || (count > INLINE_EXTENTS) != (in->reserved_1 != 0)) {
+        report(ck, CHECK_FILES, ino, "inode %u: bad extent count %u", ino, count);
+        return;
+    }
+    const extent_block_t *eb = NULL;
+    if (in->reserved_1) {
+        if (!claim_block(ck, in->reserved_1, ino, "extent")) return;
+        eb = (const extent_block_t*)mvfs_block(fs, in->reserved_1);
+        if (eb->magic != EXTENT_BLOCK_MAGIC || eb->count != count - INLINE_EXTENTS || !extent_block_crc_ok(eb)) {
+            report(ck, CHECK_FILES, ino, "inode %u: extent block %u is corrupt", ino, in->reserved_1);
+            return;
+        }
+    }
+
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        uint64_t start = k < INLINE_EXTENTS ? in->direct[2 * k] : eb->entries[k - INLINE_EXTENTS].start;
+        uint64_t len = k < INLINE_EXTENTS ? in->direct[2 * k + 1] : eb->entries[k - INLINE_EXTENTS].len;
+        for (uint64_t i = 0; i < len; i++) {
+            if (!claim_block(ck, start + i, ino, "data")) break;
+        }
+        total += len;
+    }
+    if (mvfs_is_compressed(in)) {
+        check_compressed(ck, ino, in, total);
+    } else if (total != blocks) {
+        report(ck, CHECK_FILES, ino, "inode %u: extents hold %" PRIu64 " blocks, size needs %" PRIu64, ino, total, blocks);
+    }
+}
+
+// ====================== Directories ======================
+// Checks one leaf whose names must hash into [lo, hi) and counts the references it makes
+static void check_leaf(fsck_t *ck, uint32_t ino, uint64_t block, uint64_t lo, uint64_t hi, int hashed) {
+    const dirent64_t *de = (const dirent64_t*)mvfs_block(ck->fs, block);
+    uint64_t inode_count = ck->fs->sb->inode_count;
+
+    atomic_fetch_add(&ck->checked[CHECK_DIRENTS], DIRENTS_PER_BLOCK);
+    uint64_t bad = dirent_block_checksums_bad(de);
+    for (uint64_t m = bad; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        report(ck, CHECK_DIRENTS, ino, "inode %u: dirent %d of block %" PRIu64 " fails its checksum", ino, i, block);
+    }
+
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (de[i].inode_no == 0 || (bad >> i & 1u)) continue;
+        if (memchr(de[i].name, '\0', sizeof(de[i].name)) == NULL || de[i].name[0] == '\0') {
+            report(ck, CHECK_DIRS, ino, "inode %u: dirent %u of block %" PRIu64 " has a bad name", ino, i, block);
+            continue;
+        }
+        if (de[i].inode_no > inode_count) {
+            report(ck, CHECK_DIRS, ino, "inode %u: '%.40s' names inode %u, past the last one", ino, de[i].name, de[i].inode_no);
+            continue;
+        }
+        uint32_t h = mvfs_name_hash(de[i].name);
+        if (hashed && (h < lo || h >= hi)) {
+            report(ck, CHECK_DIRS, ino, "inode %u: '%.40s' is in the wrong leaf (block %" PRIu64 ")", ino, de[i].name, block);
+        }
+        atomic_fetch_add(&ck->refs[de[i].inode_no], 1);
+    }
+}
+
+// Walks index block `block` of a hashed directory, which covers hashes [lo, hi).
+// Returns the number of directory blocks under it.
+static uint64_t check_index(fsck_t *ck, uint32_t ino, uint64_t block, uint64_t lo, uint64_t hi, int depth, int64_t level) {
+    if (!claim_block(ck, block, ino, "index")) return 0;
+    const dir_index_t *ix = (const dir_index_t*)mvfs_block(ck->fs, block);
+    if (ix->magic != DIR_INDEX_MAGIC || ix->count == 0 || !dir_index_crc_ok(ix) ||
+        depth >= DIR_INDEX_DEPTH_MAX || (level >= 0 && ix->level != (uint64_t)level)) {
+        report(ck, CHECK_DIRS, ino, "inode %u: index block %" PRIu64 " is corrupt", ino, block);
+        return 1;
+    }
+
+    uint64_t blocks = 1;
+    for (uint32_t i = 0; i < ix->count; i++) {
+        uint64_t from = i == 0 ? lo : ix->entries[i].hash;
+        uint64_t to = i + 1 < ix->count ? ix->entries[i + 1].hash : hi;
+        if (from > to || (i > 0 && ix->entries[i].hash < lo)) {
+            report(ck, CHECK_DIRS, ino, "inode %u: index block %" PRIu64 " is out of order at entry %u", ino, block, i);
+            return blocks;
+        }
+        uint64_t child = ix->entries[i].block;
+        if (ix->level > 0) {
+            blocks += check_index(ck, ino, child, from, to, depth + 1, (int64_t)ix->level - 1);
+        } else if (claim_block(ck, child, ino, "leaf")) {
+            check_leaf(ck, ino, child, from, to, 1);
+            blocks++;
+        }
+    }
+    return blocks;
+}
+
+static void check_dir(fsck_t *ck, uint32_t ino, const inode_t *in) {
+    atomic_fetch_add(&ck->checked[CHECK_DIRS], 1);
+    uint64_t blocks = 0;
+    if (in->reserved_2 & INODE_FLAG_HASHED_DIR) {
+        blocks = check_index(ck, ino, in->direct[0], 0, 1ull << 32, 0, -1);
+    } else {
+        uint64_t n = div_round_up_u64(in->size_bytes, BS);
+        if (n == 0 || n > DIRECT_MAX) {
+            report(ck, CHECK_DIRS, ino, "inode %u: directory of %" PRIu64 " bytes", ino, in->size_bytes);
+            return;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (claim_block(ck, in->direct[i], ino, "leaf")) check_leaf(ck, ino, in->direct[i], 0, 0, 0);
+        }
+        blocks = n;
+    }
+    if (blocks * BS != in->size_bytes) {
+        report(ck, CHECK_DIRS, ino, "inode %u: size %" PRIu64 " but %" PRIu64 " directory blocks", ino, in->size_bytes, blocks);
+    }
+}
+
+// ====================== Inodes ======================
+// Inode-table blocks of group `g` that were ever written
+static uint64_t initialized_blocks(const mvfs_t *fs, const mvfs_group_t *g) {
+    if (!(fs->sb->flags & SB_FLAG_LAZY_ITABLE)) return g->inode_table_blocks;
+    return g->desc ? g->desc->itable_init_blocks : fs->sb->itable_init_blocks;
+}
+
+static void check_slice(fsck_t *ck, uint64_t slice) {
+    mvfs_t *fs = ck->fs;
+    mvfs_group_t *g = &fs->groups[slice / ck->slices_per_group];
+    uint64_t lo = (slice % ck->slices_per_group) * SLICE_INODES;
+    uint64_t hi = lo + SLICE_INODES < g->inode_count ? lo + SLICE_INODES : g->inode_count;
+    uint64_t init = initialized_blocks(fs, g) * (BS / INODE_SIZE);
+
+    for (uint64_t i = lo; i < hi; i++) {
+        uint32_t ino = (uint32_t)(g->first_ino + i);
+        int allocated = test_bit(g->inode_bitmap, i);
+        if (i >= init) {
+            // Never written: must still be free
+            if (allocated) report(ck, CHECK_INODE_BITMAP, ino, "inode %u: allocated past the initialized inode table", ino);
+            continue;
+        }
+
+        const inode_t *in = mvfs_inode(fs, ino);
+        atomic_fetch_add(&ck->checked[CHECK_INODE_CRC], 1);
+        atomic_fetch_add(&ck->checked[CHECK_INODE_BITMAP], 1);
+        if (!inode_crc_ok(in)) {
+            report(ck, CHECK_INODE_CRC, ino, "inode %u: CRC mismatch", ino);
+            ck->state[ino] = INODE_BAD;
+            continue;
+        }
+
+        int in_use = in->mode != 0;
+        if (in_use != allocated) {
+            report(ck, CHECK_INODE_BITMAP, ino, in_use ? "inode %u: in use but free in the bitmap"
+                                                       : "inode %u: allocated in the bitmap but empty", ino);
+        }
+        if (!in_use) continue;
+
+        atomic_fetch_add(&ck->inodes_used, 1);
+        if ((in->mode & 0170000) == 040000) {
+            ck->state[ino] = INODE_DIR;
+            check_dir(ck, ino, in);
+        } else {
+            ck->state[ino] = INODE_FILE;
+            check_file(ck, ino, in);
+        }
+    }
+}
+
+static void *fsck_worker(void *arg) {
+    fsck_t *ck = (fsck_t*)arg;
+    for (;;) {
+        uint64_t slice = atomic_fetch_add(&ck->next_slice, 1);
+        if (slice >= ck->slice_count) break;
+        check_slice(ck, slice);
+    }
+    return NULL;
+}
+
+// ====================== Whole-image checks ======================
+static void check_superblock(fsck_t *ck) {
+    superblock_t *sb = ck->fs->sb;
+    atomic_fetch_add(&ck->checked[CHECK_SUPERBLOCK], 1);
+    if (!superblock_crc_ok(sb)) report(ck, CHECK_SUPERBLOCK, 0, "superblock: CRC mismatch");
+    if (sb->root_inode != ROOT_INO) report(ck, CHECK_SUPERBLOCK, 0, "superblock: root inode is %" PRIu64, sb->root_inode);
+}
+
+// Data bitmaps against the blocks claimed, and the descriptors' free counts
+static void check_bitmaps(fsck_t *ck) {
+    mvfs_t *fs = ck->fs;
+    for (uint64_t gi = 0; gi < fs->group_count; gi++) {
+        mvfs_group_t *g = &fs->groups[gi];
+        uint64_t free_blocks = 0;
+        atomic_fetch_add(&ck->checked[CHECK_DATA_BITMAP], g->data_blocks);
+        for (uint64_t b = 0; b < g->data_blocks; b++) {
+            uint64_t block = g->data_start + b;
+            int used = test_bit(g->data_bitmap, b);
+            int claimed = (ck->seen[block >> 6] >> (block & 63u)) & 1u;
+            free_blocks += !used;
+            if (used == claimed) continue;
+            report(ck, CHECK_DATA_BITMAP, block, claimed ? "block %" PRIu64 ": in use but free in the bitmap"
+                                                         : "block %" PRIu64 ": allocated in the bitmap but unused", block);
+        }
+
+        if (!g->desc) continue;
+        uint64_t free_inodes = 0;
+        for (uint64_t i = 0; i < g->inode_count; i++) free_inodes += !test_bit(g->inode_bitmap, i);
+        atomic_fetch_add(&ck->checked[CHECK_GROUPS], 1);
+        if (g->desc->free_blocks != free_blocks || g->desc->free_inodes != free_inodes) {
+            report(ck, CHECK_GROUPS, gi, "group %" PRIu64 ": counts %u free blocks, %u free inodes; bitmaps have %" PRIu64 ", %" PRIu64,
+                   gi, g->desc->free_blocks, g->desc->free_inodes, free_blocks, free_inodes);
+        }
+    }
+}
+
+static int cmp_fragment(const void *a, const void *b) {
+    const fragment_t *x = a, *y = b;
+    if (x->block != y->block) return x->block < y->block ? -1 : 1;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+// The open fragment block, then no two packed files sharing bytes of a block (nor using
+// the part of the open block that is still free)
+static void check_fragments(fsck_t *ck) {
+    superblock_t *sb = ck->fs->sb;
+    if (!ck->fragments) return;
+
+    if (sb->tail_block) {
+        atomic_fetch_add(&ck->checked[CHECK_SUPERBLOCK], 1);
+        if (!mvfs_data_group(ck->fs, sb->tail_block) || sb->tail_used > BS) {
+            report(ck, CHECK_SUPERBLOCK, 0, "superblock: bad open fragment block %" PRIu64 " (%" PRIu64 " bytes used)",
+                   sb->tail_block, sb->tail_used);
+        } else {
+            atomic_fetch_add(&ck->checked[CHECK_BLOCKS], 1);
+            claim_fragment(ck, sb->tail_block, (uint32_t)sb->tail_used, (uint32_t)(BS - sb->tail_used), 0);
+        }
+    }
+
+    size_t count = atomic_load(&ck->fragment_count);
+    qsort(ck->fragments, count, sizeof(fragment_t), cmp_fragment);
+    // p: the fragment reaching furthest into the block so far
+    const fragment_t *p = NULL;
+    for (size_t i = 0; i < count; i++) {
+        const fragment_t *f = &ck->fragments[i];
+        if (!p || p->block != f->block || p->offset + p->len <= f->offset) {
+            if (!p || p->block != f->block || f->offset + f->len > p->offset + p->len) p = f;
+            continue;
+        }
+        if (p->ino == 0 || f->ino == 0) {
+            report(ck, CHECK_BLOCKS, f->block, "block %" PRIu64 ": inode %u is in the free part of the open fragment block",
+                   f->block, p->ino ? p->ino : f->ino);
+        } else {
+            report(ck, CHECK_BLOCKS, f->block, "block %" PRIu64 ": fragments of inodes %u and %u overlap", f->block, p->ino, f->ino);
+        }
+        if (f->offset + f->len > p->offset + p->len) p = f;
+    }
+}
+
+// Loads the shared-block table and claims the blocks holding it, before any file is checked
+static void load_shared(fsck_t *ck) {
+    superblock_t *sb = ck->fs->sb;
+    if (!(sb->flags & SB_FLAG_SHARED_BLOCKS)) return;
+    atomic_fetch_add(&ck->checked[CHECK_SUPERBLOCK], 1);
+    if (mvfs_shared_table_read(ck->fs, &ck->shared_refs) < 0) {
+        report(ck, CHECK_SUPERBLOCK, 0, "superblock: shared-block table at %" PRIu64 " is corrupt", sb->shared_table);
+        return;
+    }
+    ck->shared_claims = calloc(sb->shared_blocks ? sb->shared_blocks : 1, sizeof(*ck->shared_claims));
+    if (!ck->shared_claims) {
+        perror("calloc shared claims");
+        return;
+    }
+    ck->shared_count = sb->shared_blocks;
+    for (uint64_t b = sb->shared_table; b != 0; b = ((const shared_table_t*)mvfs_block(ck->fs, b))->next) {
+        if (!claim_block(ck, b, 0, "shared table")) break;
+    }
+}
+
+// Every shared block named by as many files as its count in the table says
+static void check_shared(fsck_t *ck) {
+    for (uint64_t i = 0; i < ck->shared_count; i++) {
+        const shared_ref_t *e = &ck->shared_refs[i];
+        uint32_t claims = atomic_load(&ck->shared_claims[i]);
+        if (claims == e->refs) continue;
+        report(ck, CHECK_BLOCKS, e->block, "block %" PRIu64 ": shared %u time(s) but counted %u in the table", e->block, claims, e->refs);
+    }
+}
+
+static void check_links(fsck_t *ck) {
+    mvfs_t *fs = ck->fs;
+    if (ck->state[ROOT_INO] != INODE_DIR) report(ck, CHECK_LINKS, ROOT_INO, "inode %u: root is not a directory", ROOT_INO);
+
+    for (uint64_t ino = 1; ino <= fs->sb->inode_count; ino++) {
+        uint32_t refs = atomic_load(&ck->refs[ino]);
+        int state = ck->state[ino];
+        if (state == INODE_BAD) continue;
+        if (state == INODE_FREE) {
+            if (refs) report(ck, CHECK_LINKS, ino, "inode %" PRIu64 ": free but named by %u directory entries", ino, refs);
+            continue;
+        }
+        atomic_fetch_add(&ck->checked[CHECK_LINKS], 1);
+        const inode_t *in = mvfs_inode(fs, (uint32_t)ino);
+        if (refs == 0) {
+            report(ck, CHECK_LINKS, ino, "inode %" PRIu64 ": in use but in no directory", ino);
+        } else if (state == INODE_FILE && in->links != refs) {
+            report(ck, CHECK_LINKS, ino, "inode %" PRIu64 ": link count %u, named by %u directory entries", ino, in->links, refs);
+        }
+    }
+}
+
+// ====================== Report ======================
+static int cmp_problem(const void *a, const void *b) {
+    const problem_t *x = a, *y = b;
+    if (x->check != y->check) return x->check - y->check;
+    return x->subject < y->subject ? -1 : (x->subject > y->subject);
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned char)*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_report(fsck_t *ck, const char *image, int json, uint64_t total) {
+    qsort(ck->listed, ck->listed_count, sizeof(problem_t), cmp_problem);
+    superblock_t *sb = ck->fs->sb;
+
+    if (json) {
+        printf("{\"image\": ");
+        print_json_string(image);
+        printf(", \"clean\": %s, \"inodes_used\": %" PRIu64 ", \"blocks_used\": %" PRIu64 ",\n \"checks\": [",
+               total ? "false" : "true", atomic_load(&ck->inodes_used), atomic_load(&ck->blocks_used));
+        for (int c = 0; c < CHECK_COUNT; c++) {
+            printf("%s\n  {\"name\": \"%s\", \"checked\": %" PRIu64 ", \"problems\": %" PRIu64 "}", c ? "," : "",
+                   check_names[c], atomic_load(&ck->checked[c]), atomic_load(&ck->found[c]));
+        }
+        printf("],\n \"problems\": [");
+        for (size_t i = 0; i < ck->listed_count; i++) {
+            printf("%s\n  {\"check\": \"%s\", \"subject\": %" PRIu64 ", \"message\": ", i ? "," : "",
+                   check_names[ck->listed[i].check], ck->listed[i].subject);
+            print_json_string(ck->listed[i].text);
+            putchar('}');
+        }
+        printf("]}\n");
+        return;
+    }
+
+    printf("Checking '%s': version %u, %" PRIu64 " blocks, %" PRIu64 " inodes, %" PRIu64 " group(s)\n",
+           image, sb->version, sb->total_blocks, sb->inode_count, ck->fs->group_count);
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        uint64_t found = atomic_load(&ck->found[c]);
+        printf("  %-20s %12" PRIu64 " checked  %s", check_names[c], atomic_load(&ck->checked[c]), found ? "" : "ok\n");
+        if (found) printf("%" PRIu64 " problem(s)\n", found);
+    }
+    for (size_t i = 0; i < ck->listed_count; i++) printf("    %s\n", ck->listed[i].text);
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        uint64_t found = atomic_load(&ck->found[c]);
+        if (found > MAX_LISTED) printf("    ... %" PRIu64 " more %s problem(s)\n", found - MAX_LISTED, check_names[c]);
+    }
+    printf("%s: %" PRIu64 " inodes and %" PRIu64 " blocks in use, %s\n", image,
+           atomic_load(&ck->inodes_used), atomic_load(&ck->blocks_used), total ? "ERRORS FOUND" : "clean");
+}
+
+int main(int argc, char *argv[]) {
+    char *image_file = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+    int json = 0;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"threads", required_argument, 0, 't'},
+        {"json", no_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'i': image_file = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s --image <fs_image> [--threads <n>] [--json]\n", argv[0]);
+                return EXIT_USAGE;
+        }
+    }
+    if (!image_file || threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Usage: %s --image <fs_image> [--threads <n>] [--json]\n", argv[0]);
+        return EXIT_USAGE;
+    }
+
+    mvfs_init();
+
+    // A layout the library refuses cannot be checked any further
+    mvfs_t fs;
+    if (mvfs_open(&fs, image_file, 0) < 0) return EXIT_OPERATIONAL;
+
+    fsck_t ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.fs = &fs;
+    ck.slices_per_group = div_round_up_u64(fs.inodes_per_group, SLICE_INODES);
+    ck.slice_count = fs.group_count * ck.slices_per_group;
+    atomic_init(&ck.next_slice, 0);
+    ck.seen = calloc(div_round_up_u64(fs.blocks, 64), sizeof(uint64_t));
+    ck.refs = calloc(fs.sb->inode_count + 1, sizeof(*ck.refs));
+    ck.state = calloc(fs.sb->inode_count + 1, 1);
+    ck.listed = malloc(CHECK_COUNT * MAX_LISTED * sizeof(problem_t));
+    atomic_init(&ck.fragment_count, 0);
+    int packed = (fs.sb->flags & SB_FLAG_PACKED_TAILS) != 0;
+    if (packed) {
+        ck.shared = calloc(div_round_up_u64(fs.blocks, 64), sizeof(uint64_t));
+        ck.fragments = malloc((fs.sb->inode_count + 1) * sizeof(fragment_t));
+    }
+    if (!ck.seen || !ck.refs || !ck.state || !ck.listed || (packed && (!ck.shared || !ck.fragments))) {
+        perror("calloc check state");
+        mvfs_close(&fs);
+        return EXIT_OPERATIONAL;
+    }
+    pthread_mutex_init(&ck.lock, NULL);
+
+    check_superblock(&ck);
+    load_shared(&ck);
+
+    // Inodes, files and directories: slices of the inode tables over the workers
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; ++t) {
+        if (pthread_create(&tids[started], NULL, fsck_worker, &ck) != 0) break;
+        started++;
+    }
+    fsck_worker(&ck);
+    for (int t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+
+    check_fragments(&ck);
+    check_shared(&ck);
+    check_bitmaps(&ck);
+    check_links(&ck);
+
+    uint64_t total = 0;
+    for (int c = 0; c < CHECK_COUNT; c++) total += atomic_load(&ck.found[c]);
+    print_report(&ck, image_file, json, total);
+
+    pthread_mutex_destroy(&ck.lock);
+    free(ck.seen);
+    free(ck.shared);
+    free(ck.fragments);
+    free(ck.shared_refs);
+    free((void*)ck.shared_claims);
+    free(ck.refs);
+    free(ck.state);
+    free(ck.listed);
+    mvfs_close(&fs);
+    return total ? EXIT_UNCORRECTED : EXIT_CLEAN;
+}
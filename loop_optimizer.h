@@ -0,0 +1,437 @@
+#include "expression_simplifier.h"
+
+// Loop-aware analysis for the for and while forms. While a loop is being parsed
+// the grammar actions report every assignment, array access, arithmetic
+// expression and call inside it; when the loop is reduced the optimizer finds
+// the induction variable and trip count, proves array indexes in bounds,
+// strength-reduces linear a[i] indexing, lists loop-invariant expressions to
+// hoist and, if asked to, unrolls the loop.
+
+class array_access
+{
+public:
+    string array;
+    string index;
+    int array_size;     // -1 when the name is not a declared array
+
+    array_access(string array, string index, int array_size)
+    {
+        this->array = array;
+        this->index = index;
+        this->array_size = array_size;
+    }
+};
+
+class loop_info
+{
+public:
+    int start_line;
+    map<string, int> assigned;              // variable -> assignments inside the loop
+    map<string, vector<string>> updates;    // variable -> text of those assignments
+    vector<array_access> accesses;
+    vector<string> expressions;
+    bool has_calls;
+
+    loop_info(int start_line)
+    {
+        this->start_line = start_line;
+        this->has_calls = false;
+    }
+};
+
+class loop_optimizer
+{
+private:
+    vector<loop_info> active;   // innermost loop last
+    int unroll_factor;
+
+    static string base_name(string variable);
+    static bool is_int(string text, long long &value);
+    static string replace_identifier(string text, string name, string replacement);
+    bool induction_step(loop_info &loop, string var);
+    bool linear_index(loop_info &loop, string index, string var, long long &coef, long long &offset, bool &offset_known);
+    void analyze_body(loop_info &loop, string var, bool trip_known, long long first, long long trips, vector<string> &report);
+
+public:
+    loop_optimizer();
+    void set_unroll_factor(int factor);
+    void enter_loop(int line);
+    void begin_iterations();
+    void record_assignment(string variable, string text);
+    void record_array_access(string array, string index, int array_size);
+    void record_expression(string expr);
+    void record_call();
+    vector<string> exit_for(string init, string cond, string step, string body, string &unrolled);
+    vector<string> exit_while(string cond);
+    void reset();
+};
+
+//methods of loop_optimizer class
+
+loop_optimizer::loop_optimizer()
+{
+    this->unroll_factor = 1;
+}
+
+void loop_optimizer::set_unroll_factor(int factor)
+{
+    this->unroll_factor = factor < 1 ? 1 : factor;
+}
+
+void loop_optimizer::enter_loop(int line)
+{
+    active.push_back(loop_info(line));
+}
+
+void loop_optimizer::begin_iterations()
+{
+    // The init clause of a for runs once, nothing recorded so far is part of the loop
+    loop_info &loop = active.back();
+    loop.assigned.clear();
+    loop.updates.clear();
+    loop.accesses.clear();
+    loop.expressions.clear();
+    loop.has_calls = false;
+}
+
+void loop_optimizer::record_assignment(string variable, string text)
+{
+    // Enclosing loops see everything their inner loops do
+    for (auto &loop : active)
+    {
+        loop.assigned[base_name(variable)]++;
+        loop.updates[base_name(variable)].push_back(text);
+    }
+}
+
+void loop_optimizer::record_array_access(string array, string index, int array_size)
+{
+    for (auto &loop : active)
+    {
+        loop.accesses.push_back(array_access(array, index, array_size));
+    }
+}
+
+void loop_optimizer::record_expression(string expr)
+{
+    for (auto &loop : active)
+    {
+        loop.expressions.push_back(expr);
+    }
+}
+
+void loop_optimizer::record_call()
+{
+    for (auto &loop : active)
+    {
+        loop.has_calls = true;
+    }
+}
+
+void loop_optimizer::reset()
+{
+    active.clear();
+}
+
+string loop_optimizer::base_name(string variable)
+{
+    return variable.substr(0, variable.find('['));
+}
+
+bool loop_optimizer::is_int(string text, long long &value)
+{
+    if (text.empty() || text.size() > 9)
+        return false;
+
+    for (char c : text)
+    {
+        if (!isdigit((unsigned char)c))
+            return false;
+    }
+    value = stoll(text);
+    return true;
+}
+
+string loop_optimizer::replace_identifier(string text, string name, string replacement)
+{
+    string result;
+    size_t i = 0;
+    while (i < text.size())
+    {
+        if (isalpha((unsigned char)text[i]) || text[i] == '_')
+        {
+            size_t j = i;
+            while (j < text.size() && (isalnum((unsigned char)text[j]) || text[j] == '_')) j++;
+            string word = text.substr(i, j - i);
+            result += word == name ? replacement : word;
+            i = j;
+        }
+        else if (isdigit((unsigned char)text[i]))
+        {
+            // Skip whole constants so the e of 1e5 is not taken for an identifier
+            size_t j = i;
+            while (j < text.size() && (isalnum((unsigned char)text[j]) || text[j] == '.')) j++;
+            result += text.substr(i, j - i);
+            i = j;
+        }
+        else
+        {
+            result += text[i++];
+        }
+    }
+    return result;
+}
+
+bool loop_optimizer::induction_step(loop_info &loop, string var)
+{
+    // Exactly one update per iteration, and it adds one
+    if (loop.assigned[var] != 1)
+        return false;
+
+    string update = loop.updates[var][0];
+    return update == var + "++" || update == var + "=" + var + "+1" || update == var + "=1+" + var;
+}
+
+bool loop_optimizer::linear_index(loop_info &loop, string index, string var, long long &coef, long long &offset, bool &offset_known)
+{
+    // Accepts sums of var, var*K, K*var and terms that do not change inside the loop
+    vector<string> tokens = expression_simplifier::tokenize(index);
+    coef = 0;
+    offset = 0;
+    offset_known = true;
+
+    vector<vector<string>> terms;
+    vector<int> signs;
+    int sign = 1;
+    int depth = 0;
+    vector<string> current;
+
+    for (size_t i = 0; i <= tokens.size(); i++)
+    {
+        bool split = i == tokens.size() || (depth == 0 && (tokens[i] == "+" || tokens[i] == "-"));
+        if (split)
+        {
+            if (!current.empty())
+            {
+                terms.push_back(current);
+                signs.push_back(sign);
+            }
+            else if (i < tokens.size() && !terms.empty())
+            {
+                return false; // a+-b and the like
+            }
+            if (i < tokens.size())
+            {
+                sign = tokens[i] == "-" ? -1 : 1;
+            }
+            current.clear();
+            continue;
+        }
+
+        if (tokens[i] == "(" || tokens[i] == "[") depth++;
+        if (tokens[i] == ")" || tokens[i] == "]") depth--;
+        current.push_back(tokens[i]);
+    }
+
+    for (size_t t = 0; t < terms.size(); t++)
+    {
+        vector<string> &term = terms[t];
+        long long k;
+
+        if (find(term.begin(), term.end(), var) != term.end())
+        {
+            if (term.size() == 1)
+                coef += signs[t];
+            else if (term.size() == 3 && term[1] == "*" && term[0] == var && is_int(term[2], k))
+                coef += signs[t] * k;
+            else if (term.size() == 3 && term[1] == "*" && term[2] == var && is_int(term[0], k))
+                coef += signs[t] * k;
+            else
+                return false;
+        }
+        else if (term.size() == 1 && is_int(term[0], k))
+        {
+            offset += signs[t] * k;
+        }
+        else
+        {
+            string text;
+            for (auto token : term) text += token;
+            for (auto name : expression_simplifier::identifiers(text))
+            {
+                if (loop.assigned.count(name))
+                    return false;
+            }
+            if (text.find('(') != string::npos)
+                return false;
+            offset_known = false;
+        }
+    }
+
+    return true;
+}
+
+void loop_optimizer::analyze_body(loop_info &loop, string var, bool trip_known, long long first, long long trips, vector<string> &report)
+{
+    string where = "Loop at line " + to_string(loop.start_line) + ": ";
+
+    // Array indexing: bounds and strength reduction
+    set<string> seen;
+    for (auto access : loop.accesses)
+    {
+        string name = access.array + "[" + access.index + "]";
+        if (var.empty() || !seen.insert(name).second)
+            continue;
+
+        long long coef, offset;
+        bool offset_known;
+        if (!linear_index(loop, access.index, var, coef, offset, offset_known) || coef == 0)
+            continue;
+
+        report.push_back(where + name + " strength-reduced to a pointer advanced by " + to_string(coef) +
+                         " element(s) per iteration" + (offset_known ? "" : ", invariant base hoisted"));
+
+        if (!trip_known || !offset_known || access.array_size < 0 || trips == 0)
+            continue;
+
+        long long low = coef * first + offset;
+        long long high = coef * (first + trips - 1) + offset;
+        if (low > high) swap(low, high);
+
+        if (low >= 0 && high < access.array_size)
+        {
+            report.push_back(where + name + " index range [" + to_string(low) + ", " + to_string(high) +
+                             "] within size " + to_string(access.array_size) + ", bounds checks dropped");
+        }
+        else
+        {
+            report.push_back("Warning at line " + to_string(loop.start_line) + ": index range [" + to_string(low) + ", " +
+                             to_string(high) + "] of " + name + " exceeds size " + to_string(access.array_size));
+        }
+    }
+
+    // Loop-invariant expressions; a call could change any global, so give up on those loops
+    if (loop.has_calls)
+    {
+        report.push_back(where + "contains calls, invariant code motion skipped");
+        return;
+    }
+
+    vector<string> invariant;
+    for (auto expr : loop.expressions)
+    {
+        set<string> names = expression_simplifier::identifiers(expr);
+        bool is_invariant = !names.empty() && expr.find("++") == string::npos && expr.find("--") == string::npos;
+        for (auto name : names)
+        {
+            if (loop.assigned.count(name))
+                is_invariant = false;
+        }
+        if (is_invariant && find(invariant.begin(), invariant.end(), expr) == invariant.end())
+        {
+            invariant.push_back(expr);
+        }
+    }
+
+    for (auto expr : invariant)
+    {
+        bool covered = false;
+        for (auto other : invariant)
+        {
+            if (other != expr && other.find(expr) != string::npos)
+                covered = true;
+        }
+        if (!covered)
+        {
+            report.push_back(where + "invariant " + expr + " hoisted before the loop");
+        }
+    }
+}
+
+vector<string> loop_optimizer::exit_for(string init, string cond, string step, string body, string &unrolled)
+{
+    vector<string> report;
+    loop_info loop = active.back();
+    active.pop_back();
+    unrolled = "";
+
+    // Induction variable: for(v=C;v<N;v++) or v<=N, with v not otherwise changed in the body
+    string var;
+    long long first = 0, bound = 0, trips = 0;
+    bool trip_known = false;
+
+    size_t eq = init.find('=');
+    if (eq != string::npos && init.back() == ';' && induction_step(loop, init.substr(0, eq)))
+    {
+        var = init.substr(0, eq);
+        string cond_expr = cond.empty() ? cond : cond.substr(0, cond.size() - 1);
+        bool inclusive = cond_expr.compare(0, var.size() + 2, var + "<=") == 0;
+        bool exclusive = !inclusive && cond_expr.compare(0, var.size() + 1, var + "<") == 0;
+        // An empty condition (for(i=0;;i++)) or one that is not v<... (for(count=0;c;count++))
+        // has no bound to read, and may be shorter than the prefix
+        string limit;
+        if (inclusive || exclusive)
+        {
+            limit = cond_expr.substr(var.size() + (inclusive ? 2 : 1));
+        }
+
+        if ((inclusive || exclusive) && is_int(init.substr(eq + 1, init.size() - eq - 2), first) && is_int(limit, bound))
+        {
+            trips = max(0LL, bound - first + (inclusive ? 1 : 0));
+            trip_known = true;
+            report.push_back("Loop at line " + to_string(loop.start_line) + ": induction variable " + var +
+                             " from " + to_string(first) + ", " + to_string(trips) + " iterations");
+        }
+        else
+        {
+            report.push_back("Loop at line " + to_string(loop.start_line) + ": induction variable " + var + ", trip count unknown");
+        }
+    }
+
+    analyze_body(loop, var, trip_known, first, trips, report);
+
+    // Unrolling needs a known trip count and a body with a single exit
+    bool single_exit = body.find("break;") == string::npos && body.find("return ") == string::npos;
+    if (unroll_factor > 1 && trip_known && trips >= unroll_factor && single_exit)
+    {
+        long long main_trips = trips / unroll_factor * unroll_factor;
+        string copies = body;
+        for (int k = 1; k < unroll_factor; k++)
+        {
+            copies += "\n" + replace_identifier(body, var, "(" + var + "+" + to_string(k) + ")");
+        }
+
+        unrolled = "for(" + init + var + "<" + to_string(first + main_trips) + ";" + var + "=" + var + "+" +
+                   to_string(unroll_factor) + ")\n{\n" + copies + "\n}";
+        if (main_trips != trips)
+        {
+            unrolled += "\nfor(;" + cond + step + ")\n" + body;
+        }
+
+        report.push_back("Loop at line " + to_string(loop.start_line) + ": unrolled by " + to_string(unroll_factor) +
+                         ", " + to_string(trips - main_trips) + " remainder iterations");
+    }
+
+    return report;
+}
+
+vector<string> loop_optimizer::exit_while(string cond)
+{
+    vector<string> report;
+    loop_info loop = active.back();
+    active.pop_back();
+
+    // while(v<N) with a single v++ in the body; the start value is unknown here
+    string var;
+    for (auto name : expression_simplifier::identifiers(cond))
+    {
+        if (cond.compare(0, name.size() + 1, name + "<") == 0 && induction_step(loop, name))
+        {
+            var = name;
+            report.push_back("Loop at line " + to_string(loop.start_line) + ": induction variable " + var + ", trip count unknown");
+        }
+    }
+
+    analyze_body(loop, var, false, 0, 0, report);
+    return report;
+}
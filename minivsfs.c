@@ -0,0 +1,1476 @@
+// libminivsfs: see minivsfs.h
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "minivsfs.h"
+#include "minivsfs_crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+static int use_avx2 = -1;
+#endif
+
+// ====================== Checksums ======================
+void mvfs_init(void) {
+    crc32_init();
+#ifdef BITMAP_HAVE_AVX2
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+void inode_crc_finalize(inode_t *ino) {
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+
+void dirent_checksum_finalize(dirent64_t *de) {
+    const uint8_t *p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+
+void extent_block_crc_finalize(extent_block_t *eb) {
+    eb->crc = crc32(eb->entries, eb->count * sizeof(extent_t));
+}
+
+void dir_index_crc_finalize(dir_index_t *ix) {
+    ix->crc = crc32(ix->entries, ix->count * sizeof(dir_index_entry_t));
+}
+
+void group_desc_crc_finalize(group_desc_t *gd) {
+    gd->checksum = crc32(gd, GROUP_DESC_SIZE - 4);
+}
+
+void shared_table_crc_finalize(shared_table_t *st) {
+    st->crc = crc32(st->entries, st->count * sizeof(shared_ref_t));
+}
+
+void compress_header_crc_finalize(compress_header_t *h) {
+    h->crc = crc32(h->clen, h->chunks * sizeof(uint32_t));
+}
+
+int superblock_crc_ok(const superblock_t *sb) {
+    uint8_t tmp[BS];
+    memcpy(tmp, sb, BS);
+    return superblock_crc_finalize((superblock_t*)tmp) == sb->checksum;
+}
+
+int inode_crc_ok(const inode_t *ino) {
+    inode_t tmp = *ino;
+    inode_crc_finalize(&tmp);
+    return tmp.inode_crc == ino->inode_crc;
+}
+
+int dirent_checksum_ok(const dirent64_t *de) {
+    dirent64_t tmp = *de;
+    dirent_checksum_finalize(&tmp);
+    return tmp.checksum == de->checksum;
+}
+
+// A dirent's bytes XOR to 0 exactly when its checksum matches
+static inline int dirent_xor_zero(const uint8_t *p) {
+    uint64_t x = 0, w;
+    for (int i = 0; i < 64; i += 8) { memcpy(&w, p + i, 8); x ^= w; }
+    x ^= x >> 32; x ^= x >> 16; x ^= x >> 8;
+    return (uint8_t)x == 0;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// Four dirents per step: XOR their halves, then fold each one's 32 bytes down to one
+__attribute__((target("avx2")))
+static uint64_t dirent_block_bad_avx2(const uint8_t *block) {
+    uint64_t bad = 0;
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i += 4) {
+        const uint8_t *p = block + i * 64u;
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_loadu_si256((const __m256i*)(p + 32)));
+        __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + 64)), _mm256_loadu_si256((const __m256i*)(p + 96)));
+        __m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + 128)), _mm256_loadu_si256((const __m256i*)(p + 160)));
+        __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + 192)), _mm256_loadu_si256((const __m256i*)(p + 224)));
+        // 128-bit lanes: [a.lo b.lo] ^ [a.hi b.hi] leaves 16 bytes per dirent
+        __m256i ab = _mm256_xor_si256(_mm256_permute2x128_si256(a, b, 0x20), _mm256_permute2x128_si256(a, b, 0x31));
+        __m256i cd = _mm256_xor_si256(_mm256_permute2x128_si256(c, d, 0x20), _mm256_permute2x128_si256(c, d, 0x31));
+        // 16 -> 8 -> 4 -> 2 -> 1 bytes within each 128-bit lane
+        ab = _mm256_xor_si256(ab, _mm256_srli_si256(ab, 8));
+        cd = _mm256_xor_si256(cd, _mm256_srli_si256(cd, 8));
+        ab = _mm256_xor_si256(ab, _mm256_srli_si256(ab, 4));
+        cd = _mm256_xor_si256(cd, _mm256_srli_si256(cd, 4));
+        ab = _mm256_xor_si256(ab, _mm256_srli_si256(ab, 2));
+        cd = _mm256_xor_si256(cd, _mm256_srli_si256(cd, 2));
+        ab = _mm256_xor_si256(ab, _mm256_srli_si256(ab, 1));
+        cd = _mm256_xor_si256(cd, _mm256_srli_si256(cd, 1));
+        uint32_t x0 = (uint32_t)_mm256_extract_epi8(ab, 0), x1 = (uint32_t)_mm256_extract_epi8(ab, 16);
+        uint32_t x2 = (uint32_t)_mm256_extract_epi8(cd, 0), x3 = (uint32_t)_mm256_extract_epi8(cd, 16);
+        bad |= (uint64_t)((x0 != 0) | (x1 != 0) << 1 | (x2 != 0) << 2 | (x3 != 0) << 3) << i;
+    }
+    return bad;
+}
+#endif
+
+uint64_t dirent_block_checksums_bad(const dirent64_t *block) {
+    const uint8_t *p = (const uint8_t*)block;
+    uint64_t bad = 0;
+#ifdef BITMAP_HAVE_AVX2
+    if (use_avx2 > 0) {
+        bad = dirent_block_bad_avx2(p);
+    } else
+#endif
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (!dirent_xor_zero(p + i * 64u)) bad |= 1ull << i;
+    }
+    // Free slots are not checked
+    for (uint64_t m = bad; m; m &= m - 1) {
+        int i = __builtin_ctzll(m);
+        if (block[i].inode_no == 0) bad &= ~(1ull << i);
+    }
+    return bad;
+}
+
+int extent_block_crc_ok(const extent_block_t *eb) {
+    return eb->count <= EXTENT_BLOCK_MAX && eb->crc == crc32(eb->entries, eb->count * sizeof(extent_t));
+}
+
+int dir_index_crc_ok(const dir_index_t *ix) {
+    return ix->count <= DIR_INDEX_MAX && ix->crc == crc32(ix->entries, ix->count * sizeof(dir_index_entry_t));
+}
+
+int group_desc_crc_ok(const group_desc_t *gd) {
+    return gd->checksum == crc32(gd, GROUP_DESC_SIZE - 4);
+}
+
+int shared_table_crc_ok(const shared_table_t *st) {
+    return st->count <= SHARED_TABLE_MAX && st->crc == crc32(st->entries, st->count * sizeof(shared_ref_t));
+}
+
+// ====================== Bitmaps ======================
+// Bit i lives in byte i/8, bit i%8, which on a little-endian load is bit i%64 of word i/64.
+static inline uint64_t bitmap_word(const uint8_t *bitmap, uint64_t w) {
+    uint64_t v;
+    memcpy(&v, bitmap + w * 8u, 8);
+    return v;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+// Skips 256-bit groups of words that are all `flip` (all ones or all zeros) starting
+// at word w; never passes `last`
+__attribute__((target("avx2")))
+static uint64_t skip_uniform_words_avx2(const uint8_t *bitmap, uint64_t w, uint64_t last, uint64_t flip) {
+    const __m256i f = _mm256_set1_epi64x((long long)flip);
+    while (w + 3 <= last) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(bitmap + w * 8u)), f);
+        if (!_mm256_testz_si256(v, v)) break;
+        w += 4;
+    }
+    return w;
+}
+#endif
+
+// Index of the first bit in [from, to) that is not `skip` (0 or 1), or `to` if there is none
+static uint64_t scan_bitmap(const uint8_t *bitmap, uint64_t from, uint64_t to, int skip) {
+    if (from >= to) return to;
+
+    uint64_t flip = skip ? ~0ull : 0;
+    uint64_t w = from >> 6;
+    uint64_t last = (to - 1) >> 6;
+    uint64_t hits = (bitmap_word(bitmap, w) ^ flip) & (~0ull << (from & 63u));
+    while (hits == 0) {
+        if (++w > last) return to;
+#ifdef BITMAP_HAVE_AVX2
+        if (use_avx2 < 0) use_avx2 = __builtin_cpu_supports("avx2");
+        if (use_avx2) w = skip_uniform_words_avx2(bitmap, w, last, flip);
+#endif
+        hits = bitmap_word(bitmap, w) ^ flip;
+    }
+
+    uint64_t bit = (w << 6) + (uint64_t)__builtin_ctzll(hits);
+    return bit < to ? bit : to;
+}
+
+uint64_t scan_clear_bit(const uint8_t *bitmap, uint64_t from, uint64_t to) {
+    return scan_bitmap(bitmap, from, to, 1);
+}
+
+uint64_t scan_set_bit(const uint8_t *bitmap, uint64_t from, uint64_t to) {
+    return scan_bitmap(bitmap, from, to, 0);
+}
+
+uint64_t find_clear_bit(const uint8_t *bitmap, uint64_t nbits, uint64_t cursor) {
+    if (cursor >= nbits) cursor = 0;
+    uint64_t bit = scan_clear_bit(bitmap, cursor, nbits);
+    if (bit < nbits) return bit;
+    bit = scan_clear_bit(bitmap, 0, cursor);
+    return bit < cursor ? bit : nbits;
+}
+
+// ====================== Statistics ======================
+mvfs_stats_t mvfs_stats;
+
+uint64_t mvfs_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void mvfs_stats_print_json(FILE *out, const char *tool, uint64_t files, uint64_t file_bytes, uint64_t wall_ns) {
+    static const char *const names[MVFS_PHASE_COUNT] = {
+        "layout", "bitmap_load", "allocation", "data_copy", "metadata_writeback"
+    };
+    struct rusage ru;
+    long peak_kib = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;   // Linux reports KiB
+
+    fprintf(out, "{\"tool\":\"%s\",\"files\":%" PRIu64 ",\"file_bytes\":%" PRIu64 ",\"wall_ns\":%" PRIu64 ",\"phases_ns\":{",
+            tool, files, file_bytes, wall_ns);
+    for (int p = 0; p < MVFS_PHASE_COUNT; p++) {
+        fprintf(out, "%s\"%s\":%" PRIu64, p ? "," : "", names[p], __atomic_load_n(&mvfs_stats.phase_ns[p], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "},\"io_calls\":%" PRIu64 ",\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64 ",\"peak_rss_kib\":%ld}\n",
+            __atomic_load_n(&mvfs_stats.io_calls, __ATOMIC_RELAXED),
+            __atomic_load_n(&mvfs_stats.bytes_read, __ATOMIC_RELAXED),
+            __atomic_load_n(&mvfs_stats.bytes_written, __ATOMIC_RELAXED), peak_kib);
+    fflush(out);
+}
+
+// ====================== I/O queue ======================
+enum { IO_OP_READ, IO_OP_WRITE, IO_OP_SYNC };
+
+typedef struct {
+    int kind;               // IO_OP_*
+    int buffer;             // buffer the request uses, -1 for a sync
+    const uint8_t *buf;
+    uint64_t len;
+    uint64_t off;
+} io_op_t;
+
+static int io_uring_setup_raw(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter_raw(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register_raw(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void io_fail(mvfs_io_t *io, int rc, const char *what, int err) {
+    if (rc == 1 && io->result != 0) return;
+    if (rc < 0 && io->result < 0) return;
+    if (err) fprintf(stderr, "%s: %s\n", what, strerror(err));
+    else fprintf(stderr, "%s\n", what);
+    if (rc < 0 || io->result == 0) io->result = rc;
+}
+
+static int io_buffer_index(const mvfs_io_t *io, const uint8_t *buf) {
+    return (int)((uint64_t)(buf - io->buffers) / MVFS_IO_BUFFER_BYTES);
+}
+
+static void io_unref(mvfs_io_t *io, int buffer) {
+    if (--io->refs[buffer] == 0) io->free_buffers[io->free_count++] = (uint32_t)buffer;
+}
+
+// pwrite until done; 0 or the errno of the failure
+static int io_pwrite_all(int fd, const uint8_t *buf, uint64_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)off);
+        mvfs_count_io(1, 0, n > 0 ? (uint64_t)n : 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n < 0 ? errno : EIO;
+        buf += n;
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+static int io_setup_ring(mvfs_io_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ring_fd = io_uring_setup_raw(io->entries, &p);
+    if (ring_fd < 0) return -1;
+
+    io->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    io->cq_ring_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_bytes > io->sq_ring_bytes) io->sq_ring_bytes = io->cq_ring_bytes;
+        io->cq_ring_bytes = io->sq_ring_bytes;
+    }
+    io->sq_ring = mmap(NULL, io->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED) { io->sq_ring = NULL; close(ring_fd); return -1; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ring = io->sq_ring;
+    } else {
+        io->cq_ring = mmap(NULL, io->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED) { io->cq_ring = NULL; close(ring_fd); return -1; }
+    }
+    io->sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) { io->sqes = NULL; close(ring_fd); return -1; }
+
+    uint8_t *sq = (uint8_t*)io->sq_ring, *cq = (uint8_t*)io->cq_ring;
+    io->sq_head = (uint32_t*)(sq + p.sq_off.head);
+    io->sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    io->sq_mask = (uint32_t*)(sq + p.sq_off.ring_mask);
+    io->sq_array = (uint32_t*)(sq + p.sq_off.array);
+    io->cq_head = (uint32_t*)(cq + p.cq_off.head);
+    io->cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    io->cq_mask = (uint32_t*)(cq + p.cq_off.ring_mask);
+    io->cqes = cq + p.cq_off.cqes;
+    io->entries = p.sq_entries;
+    io->ring_fd = ring_fd;
+
+    // Fixed buffers pin memory; without them the plain opcodes use the same buffers
+    struct iovec iov = { io->buffers, (size_t)io->depth * MVFS_IO_BUFFER_BYTES };
+    io->fixed = io_uring_register_raw(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return 0;
+}
+
+int mvfs_io_init(mvfs_io_t *io, int fd, int backend, unsigned depth) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->ring_fd = -1;
+    io->depth = depth ? depth : 1;
+    io->entries = 2 * io->depth;    // a copy takes two
+
+    void *p = mmap(NULL, (size_t)io->depth * MVFS_IO_BUFFER_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { perror("mmap I/O buffers"); return -1; }
+    io->buffers = (uint8_t*)p;
+    io->refs = calloc(io->depth, sizeof(uint32_t));
+    io->free_buffers = malloc(io->depth * sizeof(uint32_t));
+    io->ops = malloc(io->entries * sizeof(io_op_t));
+    io->free_ops = malloc(io->entries * sizeof(uint32_t));
+    if (!io->refs || !io->free_buffers || !io->ops || !io->free_ops) {
+        perror("malloc I/O queue");
+        mvfs_io_close(io);
+        return -1;
+    }
+    for (unsigned i = 0; i < io->depth; i++) io->free_buffers[i] = io->depth - 1 - i;
+    io->free_count = io->depth;
+
+    if (backend != MVFS_IO_SYNC && io_setup_ring(io) < 0) {
+        if (backend == MVFS_IO_URING) {
+            perror("io_uring_setup");
+            mvfs_io_close(io);
+            return -1;
+        }
+        io->entries = 2 * io->depth;
+    }
+    // The ring may have rounded the slot count up; the op table follows it
+    if (io->ring_fd >= 0 && io->entries > 2 * io->depth) {
+        void *ops = realloc(io->ops, io->entries * sizeof(io_op_t));
+        uint32_t *free_ops = ops ? realloc(io->free_ops, io->entries * sizeof(uint32_t)) : NULL;
+        if (ops) io->ops = ops;
+        if (free_ops) io->free_ops = free_ops;
+        if (!ops || !free_ops) { perror("realloc I/O queue"); mvfs_io_close(io); return -1; }
+    }
+    for (unsigned i = 0; i < io->entries; i++) io->free_ops[i] = io->entries - 1 - i;
+    io->free_op_count = io->entries;
+    return 0;
+}
+
+void mvfs_io_close(mvfs_io_t *io) {
+    if (io->ring_fd >= 0) {
+        mvfs_io_wait(io);
+        close(io->ring_fd);
+    }
+    if (io->sqes) munmap(io->sqes, io->sqes_bytes);
+    if (io->cq_ring && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_bytes);
+    if (io->sq_ring) munmap(io->sq_ring, io->sq_ring_bytes);
+    if (io->buffers) munmap(io->buffers, (size_t)io->depth * MVFS_IO_BUFFER_BYTES);
+    free(io->refs);
+    free(io->free_buffers);
+    free(io->ops);
+    free(io->free_ops);
+    memset(io, 0, sizeof(*io));
+    io->ring_fd = -1;
+}
+
+static void io_complete(mvfs_io_t *io, const struct io_uring_cqe *cqe) {
+    io_op_t *op = &((io_op_t*)io->ops)[cqe->user_data];
+    int res = cqe->res;
+    switch (op->kind) {
+    case IO_OP_READ:
+        // A short read cancels the linked write, whose completion is then ignored
+        if (res > 0) mvfs_count_io(0, (uint64_t)res, 0);
+        if (res < 0) io_fail(io, 1, "read source file data", -res);
+        else if ((uint64_t)res < op->len) io_fail(io, 1, "Source file shrank while reading", 0);
+        break;
+    case IO_OP_WRITE:
+        if (res == -ECANCELED) break;
+        if (res > 0) mvfs_count_io(0, 0, (uint64_t)res);
+        if (res < 0) {
+            io_fail(io, -1, "write data block", -res);
+        } else if ((uint64_t)res < op->len) {
+            // Short write: finish it here
+            int err = io_pwrite_all(io->fd, op->buf + res, op->len - (uint64_t)res, op->off + (uint64_t)res);
+            if (err) io_fail(io, -1, "write data block", err);
+        }
+        break;
+    case IO_OP_SYNC:
+        if (res < 0) io_fail(io, -1, "sync image", -res);
+        break;
+    }
+    if (op->buffer >= 0 && op->kind != IO_OP_READ) io_unref(io, op->buffer);
+    io->free_ops[io->free_op_count++] = (uint32_t)cqe->user_data;
+}
+
+// Submits what is queued and reaps completions, waiting for at least `wait` of them
+static void io_submit(mvfs_io_t *io, unsigned wait) {
+    for (;;) {
+        if (wait > io->in_flight + io->queued) wait = io->in_flight + io->queued;
+        int n = io_uring_enter_raw(io->ring_fd, io->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        mvfs_count_io(1, 0, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EBUSY)) n = 0;   // reap below, then try again
+        if (n < 0) {
+            io_fail(io, -1, "io_uring_enter", errno);
+            return;
+        }
+        io->queued -= (unsigned)n;
+        io->in_flight += (unsigned)n;
+        break;
+    }
+
+    uint32_t head = *io->cq_head;
+    uint32_t tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_complete(io, &((struct io_uring_cqe*)io->cqes)[head & *io->cq_mask]);
+        head++;
+        io->in_flight--;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Next submission slot with its op; waits for room first
+static struct io_uring_sqe *io_get_sqe(mvfs_io_t *io, int kind, int buffer, const uint8_t *buf, uint64_t len, uint64_t off) {
+    while (io->free_op_count == 0) io_submit(io, 1);
+
+    uint32_t slot = io->free_ops[--io->free_op_count];
+    io_op_t *op = &((io_op_t*)io->ops)[slot];
+    op->kind = kind;
+    op->buffer = buffer;
+    op->buf = buf;
+    op->len = len;
+    op->off = off;
+
+    uint32_t tail = *io->sq_tail;
+    uint32_t index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe*)io->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = slot;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->queued++;
+    return sqe;
+}
+
+uint8_t *mvfs_io_buffer(mvfs_io_t *io) {
+    while (io->free_count == 0) io_submit(io, 1);
+    uint32_t b = io->free_buffers[--io->free_count];
+    io->refs[b] = 1;
+    return io->buffers + (size_t)b * MVFS_IO_BUFFER_BYTES;
+}
+
+void mvfs_io_release(mvfs_io_t *io, uint8_t *buf) {
+    io_unref(io, io_buffer_index(io, buf));
+}
+
+void mvfs_io_write(mvfs_io_t *io, const uint8_t *buf, size_t len, uint64_t off) {
+    if (!mvfs_io_async(io)) {
+        int err = io_pwrite_all(io->fd, buf, len, off);
+        if (err) io_fail(io, -1, "write data block", err);
+        return;
+    }
+    int b = io_buffer_index(io, buf);
+    io->refs[b]++;
+    struct io_uring_sqe *sqe = io_get_sqe(io, IO_OP_WRITE, b, buf, len, off);
+    sqe->opcode = io->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = off;
+}
+
+void mvfs_io_copy(mvfs_io_t *io, int src_fd, uint64_t src_off, size_t len, uint64_t dst_off) {
+    uint8_t *buf = mvfs_io_buffer(io);
+    if (!mvfs_io_async(io)) {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(src_fd, buf + got, len - got, (off_t)(src_off + got));
+            mvfs_count_io(1, n > 0 ? (uint64_t)n : 0, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { io_fail(io, 1, "read source file data", errno); break; }
+            if (n == 0) { io_fail(io, 1, "Source file shrank while reading", 0); break; }
+            got += (size_t)n;
+        }
+        if (got == len) mvfs_io_write(io, buf, len, dst_off);
+        mvfs_io_release(io, buf);
+        return;
+    }
+
+    // Both requests need a slot; the read must not be submitted without its write
+    while (io->free_op_count < 2) io_submit(io, 1);
+    int b = io_buffer_index(io, buf);
+    struct io_uring_sqe *sqe = io_get_sqe(io, IO_OP_READ, b, buf, len, src_off);
+    sqe->opcode = io->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = src_fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = src_off;
+    mvfs_io_write(io, buf, len, dst_off);
+    mvfs_io_release(io, buf);
+}
+
+void mvfs_io_sync(mvfs_io_t *io, uint64_t off, uint64_t len, int after) {
+    if (!mvfs_io_async(io)) return;
+    while (len > 0) {
+        uint64_t part = len > (1u << 30) ? (1u << 30) : len;    // sqe->len is 32 bits
+        struct io_uring_sqe *sqe = io_get_sqe(io, IO_OP_SYNC, -1, NULL, part, off);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = after ? IOSQE_IO_DRAIN : 0;
+        sqe->fd = io->fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->off = off;
+        sqe->len = (uint32_t)part;
+        off += part;
+        len -= part;
+        after = 0;
+    }
+}
+
+int mvfs_io_wait(mvfs_io_t *io) {
+    if (mvfs_io_async(io)) {
+        while (io->queued + io->in_flight > 0) {
+            unsigned before = io->queued + io->in_flight;
+            io_submit(io, io->queued + io->in_flight);
+            if (io->queued + io->in_flight == before && io->result < 0) break;   // the ring is unusable
+        }
+    }
+    int rc = io->result;
+    io->result = 0;
+    return rc;
+}
+
+// ====================== Mapped image ======================
+int mvfs_map(mvfs_t *fs, int fd, int writable) {
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = fd;
+    fs->writable = writable;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("stat image"); return -1; }
+    if (st.st_size < (off_t)BS) { fprintf(stderr, "Image too small\n"); return -1; }
+    fs->blocks = (uint64_t)st.st_size / BS;
+
+    void *p = mmap(NULL, fs->blocks * BS, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) { perror("mmap image"); return -1; }
+    fs->base = (uint8_t*)p;
+
+    fs->dirty = calloc(fs->blocks, 1);
+    if (!fs->dirty) {
+        perror("calloc dirty map");
+        munmap(fs->base, fs->blocks * BS);
+        fs->base = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void set_group_bitmaps(mvfs_t *fs, mvfs_group_t *g) {
+    g->inode_bitmap = mvfs_block(fs, g->inode_bitmap_start);
+    g->data_bitmap = mvfs_block(fs, g->data_bitmap_start);
+    fs->data_blocks += g->data_blocks;
+}
+
+// Builds fs->groups: the descriptor table, or one group made of the superblock's regions
+static int load_groups(mvfs_t *fs) {
+    superblock_t *sb = fs->sb;
+    int grouped = (sb->flags & SB_FLAG_BLOCK_GROUPS) != 0;
+
+    if (grouped && (sb->group_count == 0 || sb->inodes_per_group == 0 || sb->blocks_per_group == 0 ||
+                    sb->group_count * sb->inodes_per_group != sb->inode_count ||
+                    sb->group_count > sb->group_desc_blocks * GROUP_DESCS_PER_BLOCK ||
+                    sb->group_desc_start + sb->group_desc_blocks > sb->total_blocks)) {
+        fprintf(stderr, "Group descriptor table does not fit the image\n");
+        return -1;
+    }
+
+    fs->group_count = grouped ? sb->group_count : 1;
+    fs->inodes_per_group = grouped ? sb->inodes_per_group : sb->inode_count;
+    fs->data_blocks = 0;
+    fs->groups = calloc(fs->group_count, sizeof(mvfs_group_t));
+    if (!fs->groups) { perror("calloc group table"); return -1; }
+
+    if (!grouped) {
+        mvfs_group_t *g = &fs->groups[0];
+        g->first_ino = 1;
+        g->inode_count = sb->inode_count;
+        g->inode_bitmap_start = sb->inode_bitmap_start;
+        g->inode_table_start = sb->inode_table_start;
+        g->inode_table_blocks = sb->inode_table_blocks;
+        g->data_bitmap_start = sb->data_bitmap_start;
+        g->data_start = sb->data_region_start;
+        g->data_blocks = sb->data_region_blocks;
+        g->data_cursor = &sb->data_cursor;
+        set_group_bitmaps(fs, g);
+        return 0;
+    }
+
+    uint64_t ibm_blocks = div_round_up_u64(sb->inodes_per_group, BS * 8u);
+    uint64_t itable_blocks = div_round_up_u64(sb->inodes_per_group, BS / INODE_SIZE);
+    group_desc_t *descs = (group_desc_t*)mvfs_block(fs, sb->group_desc_start);
+    for (uint64_t i = 0; i < fs->group_count; i++) {
+        group_desc_t *gd = &descs[i];
+        if (!group_desc_crc_ok(gd)) {
+            fprintf(stderr, "Group %" PRIu64 " descriptor checksum mismatch\n", i);
+            return -1;
+        }
+        if (gd->inode_bitmap_start + ibm_blocks > sb->total_blocks ||
+            gd->data_bitmap_start + div_round_up_u64(gd->data_region_blocks, BS * 8u) > sb->total_blocks ||
+            gd->inode_table_start + itable_blocks > sb->total_blocks ||
+            gd->data_region_start + gd->data_region_blocks > sb->total_blocks) {
+            fprintf(stderr, "Group %" PRIu64 " layout does not fit the image\n", i);
+            return -1;
+        }
+
+        mvfs_group_t *g = &fs->groups[i];
+        g->desc = gd;
+        g->first_ino = i * sb->inodes_per_group + 1;
+        g->inode_count = sb->inodes_per_group;
+        g->inode_bitmap_start = gd->inode_bitmap_start;
+        g->inode_table_start = gd->inode_table_start;
+        g->inode_table_blocks = itable_blocks;
+        g->data_bitmap_start = gd->data_bitmap_start;
+        g->data_start = gd->data_region_start;
+        g->data_blocks = gd->data_region_blocks;
+        g->data_cursor = &gd->data_cursor;
+        set_group_bitmaps(fs, g);
+    }
+    return 0;
+}
+
+int mvfs_load(mvfs_t *fs) {
+    superblock_t *sb = (superblock_t*)fs->base;
+
+    // Verify magic number
+    if (sb->magic != MVSF_MAGIC) {
+        fprintf(stderr, "Invalid filesystem magic number\n");
+        return -1;
+    }
+    if (sb->version < MVSF_VERSION_DIRECT || sb->version > MVSF_VERSION_COMPRESSED) {
+        fprintf(stderr, "Unsupported filesystem version %u\n", sb->version);
+        return -1;
+    }
+    // With block groups the regions are group 0's, which holds inodes_per_group inodes
+    uint64_t inodes = (sb->flags & SB_FLAG_BLOCK_GROUPS) ? sb->inodes_per_group : sb->inode_count;
+    if (sb->block_size != BS || sb->total_blocks > fs->blocks ||
+        sb->inode_bitmap_start + sb->inode_bitmap_blocks > sb->total_blocks ||
+        sb->data_bitmap_start + sb->data_bitmap_blocks > sb->total_blocks ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->total_blocks ||
+        sb->data_region_start + sb->data_region_blocks > sb->total_blocks ||
+        inodes > sb->inode_table_blocks * (BS / INODE_SIZE) ||
+        inodes > sb->inode_bitmap_blocks * BS * 8u ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * BS * 8u) {
+        fprintf(stderr, "Superblock layout does not fit the image\n");
+        return -1;
+    }
+
+    fs->sb = sb;
+    return load_groups(fs);
+}
+
+int mvfs_open(mvfs_t *fs, const char *path, int writable) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open filesystem image");
+        return -1;
+    }
+    if (mvfs_map(fs, fd, writable) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (mvfs_load(fs) < 0) {
+        mvfs_close(fs);
+        return -1;
+    }
+    return 0;
+}
+
+// Syncs each run of blocks flagged `flag`, widened to whole pages: an msync, or a datasync
+// on the io_uring queue, where the first one waits for everything queued before it
+static int commit_runs(mvfs_t *fs, uint8_t flag) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    int queued = fs->io && mvfs_io_async(fs->io);
+    int first = 1;
+    int rc = 0;
+    for (uint64_t b = 0; b < fs->blocks; ) {
+        if (!(fs->dirty[b] & flag)) { b++; continue; }
+        uint64_t e = b;
+        while (e < fs->blocks && (fs->dirty[e] & flag)) fs->dirty[e++] &= (uint8_t)~flag;
+
+        uint64_t lo = (b * BS) / page * page;
+        uint64_t hi = e * BS;
+        if (queued) {
+            mvfs_io_sync(fs->io, lo, hi - lo, first);
+            first = 0;
+        } else if (msync(fs->base + lo, hi - lo, MS_SYNC) < 0) {
+            perror("msync image");
+            rc = -1;
+        }
+        // Data blocks were already counted by the writes that filled them
+        mvfs_count_io(queued ? 0 : 1, 0, flag == MVFS_DIRTY_META ? hi - lo : 0);
+        b = e;
+    }
+    return rc;
+}
+
+int mvfs_commit(mvfs_t *fs) {
+    if (!fs->writable) return 0;
+
+    if (fs->sb) {
+        superblock_t *sb = fs->sb;
+        if (sb->flags & SB_FLAG_BLOCK_GROUPS) {
+            for (uint64_t i = 0; i < fs->group_count; i++) group_desc_crc_finalize(fs->groups[i].desc);
+            mvfs_mark_dirty(fs, sb->group_desc_start, sb->group_desc_blocks);
+        }
+        superblock_crc_finalize(sb);
+        fs->dirty[0] |= MVFS_DIRTY_META;
+    }
+
+    // Data first: the metadata runs queued after it start only once it is on disk
+    int rc = commit_runs(fs, MVFS_DIRTY_DATA);
+    if (commit_runs(fs, MVFS_DIRTY_META) < 0) rc = -1;
+    if (fs->io && mvfs_io_async(fs->io) && mvfs_io_wait(fs->io) != 0) rc = -1;
+    return rc;
+}
+
+int mvfs_pin(mvfs_t *fs, uint64_t block, uint64_t count, uint64_t budget) {
+    if (count == 0 || block >= fs->blocks) return -1;
+    if (count > fs->blocks - block) count = fs->blocks - block;
+    uint64_t bytes = count * BS;
+    if (fs->pinned + bytes > budget) return -1;
+    // Also faults the blocks in, so the first update does not wait for them
+    if (mlock(mvfs_block(fs, block), bytes) < 0) return -1;
+    fs->pinned += bytes;
+    return 0;
+}
+
+void mvfs_unpin(mvfs_t *fs, uint64_t block, uint64_t count) {
+    if (count == 0 || block >= fs->blocks) return;
+    if (count > fs->blocks - block) count = fs->blocks - block;
+    if (munlock(mvfs_block(fs, block), count * BS) == 0) {
+        fs->pinned -= count * BS < fs->pinned ? count * BS : fs->pinned;
+    }
+}
+
+uint64_t mvfs_pin_metadata(mvfs_t *fs, uint64_t budget) {
+    superblock_t *sb = fs->sb;
+    uint64_t before = fs->pinned;
+
+    mvfs_pin(fs, 0, 1, budget);
+    if (sb->flags & SB_FLAG_BLOCK_GROUPS) mvfs_pin(fs, sb->group_desc_start, sb->group_desc_blocks, budget);
+    mvfs_pin(fs, fs->groups[0].inode_table_start, 1, budget);
+    const inode_t *root = mvfs_inode(fs, ROOT_INO);
+    if (inode_crc_ok(root) && mvfs_data_group(fs, root->direct[0])) mvfs_pin(fs, root->direct[0], 1, budget);
+
+    // A group whose bitmaps do not fit whole still gets their first blocks
+    for (uint64_t i = 0; i < fs->group_count; i++) {
+        mvfs_group_t *g = &fs->groups[i];
+        uint64_t ib = (g->inode_count + BS * 8u - 1) / (BS * 8u);
+        uint64_t db = (g->data_blocks + BS * 8u - 1) / (BS * 8u);
+        while (ib > 0 && mvfs_pin(fs, g->inode_bitmap_start, ib, budget) < 0) ib /= 2;
+        while (db > 0 && mvfs_pin(fs, g->data_bitmap_start, db, budget) < 0) db /= 2;
+        if (ib == 0 && db == 0) break;
+    }
+    return fs->pinned - before;
+}
+
+void mvfs_close(mvfs_t *fs) {
+    if (fs->base) munmap(fs->base, fs->blocks * BS);
+    free(fs->dirty);
+    free(fs->groups);
+    if (fs->fd >= 0) close(fs->fd);
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = -1;
+}
+
+// ====================== Groups ======================
+mvfs_group_t *mvfs_data_group(mvfs_t *fs, uint64_t block) {
+    superblock_t *sb = fs->sb;
+    uint64_t i = 0;
+    if (sb->flags & SB_FLAG_BLOCK_GROUPS) {
+        uint64_t base = sb->group_desc_start + sb->group_desc_blocks;
+        if (block < base) return NULL;
+        i = (block - base) / sb->blocks_per_group;
+        if (i >= fs->group_count) return NULL;
+    }
+    mvfs_group_t *g = &fs->groups[i];
+    return block >= g->data_start && block - g->data_start < g->data_blocks ? g : NULL;
+}
+
+uint64_t mvfs_alloc_block(mvfs_t *fs, uint64_t group) {
+    for (uint64_t i = 0; i < fs->group_count; i++) {
+        mvfs_group_t *g = &fs->groups[(group + i) % fs->group_count];
+        if (g->desc && g->desc->free_blocks == 0) continue;
+
+        uint64_t bit = find_clear_bit(g->data_bitmap, g->data_blocks, *g->data_cursor);
+        if (bit == g->data_blocks) continue;
+        set_bit(g->data_bitmap, bit);
+        *g->data_cursor = bit + 1;
+        mvfs_group_count(g, 0, -1);
+        mvfs_mark_bits_dirty(fs, g->data_bitmap_start, bit, 1);
+        return g->data_start + bit;
+    }
+    return 0;
+}
+
+void mvfs_free_block(mvfs_t *fs, uint64_t block) {
+    mvfs_group_t *g = mvfs_data_group(fs, block);
+    if (!g) return;
+    clear_bit(g->data_bitmap, block - g->data_start);
+    mvfs_group_count(g, 0, 1);
+    mvfs_mark_bits_dirty(fs, g->data_bitmap_start, block - g->data_start, 1);
+}
+
+// ====================== Inodes ======================
+void mvfs_empty_inode_block(uint64_t inode_count, uint64_t table_block, uint8_t *block) {
+    uint64_t inodes_per_block = BS / INODE_SIZE;
+    inode_t empty;
+    memset(&empty, 0, sizeof(empty));
+    inode_crc_finalize(&empty);
+
+    uint64_t first = table_block * inodes_per_block;
+    uint64_t valid = inode_count > first ? inode_count - first : 0;
+    if (valid > inodes_per_block) valid = inodes_per_block;
+    memset(block, 0, BS);
+    for (uint64_t i = 0; i < valid; i++) memcpy(block + i * INODE_SIZE, &empty, INODE_SIZE);
+}
+
+void mvfs_put_inode(mvfs_t *fs, uint32_t ino, inode_t *in) {
+    superblock_t *sb = fs->sb;
+    mvfs_group_t *g = mvfs_inode_group(fs, ino);
+    uint64_t b = (ino - g->first_ino) / (BS / INODE_SIZE);
+
+    // With a lazily built table, blocks past the high-water mark are still holes
+    uint64_t done = g->desc ? g->desc->itable_init_blocks : sb->itable_init_blocks;
+    if ((sb->flags & SB_FLAG_LAZY_ITABLE) && b >= done) {
+        for (uint64_t t = done; t <= b; t++) {
+            mvfs_empty_inode_block(g->inode_count, t, mvfs_block(fs, g->inode_table_start + t));
+        }
+        mvfs_mark_dirty(fs, g->inode_table_start + done, b + 1 - done);
+        if (g->desc) {
+            g->desc->itable_init_blocks = (uint32_t)(b + 1);  // the flag stays: other groups may lag
+        } else {
+            sb->itable_init_blocks = b + 1;
+            if (sb->itable_init_blocks >= sb->inode_table_blocks) sb->flags &= ~SB_FLAG_LAZY_ITABLE; // fully written now
+        }
+    }
+
+    inode_crc_finalize(in);
+    *mvfs_inode(fs, ino) = *in;
+    mvfs_mark_dirty(fs, g->inode_table_start + b, 1);
+}
+
+int mvfs_file_runs(mvfs_t *fs, const inode_t *in, mvfs_run_t *runs, int max) {
+    uint64_t blocks = div_round_up_u64(in->size_bytes, BS);
+    const extent_block_t *eb = NULL;
+    uint32_t pieces;
+    if (mvfs_is_packed(in)) return -1;
+    if (in->reserved_2 & INODE_FLAG_EXTENTS) {
+        pieces = in->reserved_0;
+        if (pieces > EXTENT_MAX) return -1;
+        if (pieces > INLINE_EXTENTS) {
+            if (!mvfs_data_group(fs, in->reserved_1)) return -1;
+            eb = (const extent_block_t*)mvfs_block(fs, in->reserved_1);
+            if (eb->magic != EXTENT_BLOCK_MAGIC || eb->count != pieces - INLINE_EXTENTS || !extent_block_crc_ok(eb)) return -1;
+        }
+    } else {
+        if (blocks > DIRECT_MAX || mvfs_is_compressed(in)) return -1;
+        pieces = (uint32_t)blocks;
+    }
+
+    int count = 0;
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < pieces; k++) {
+        uint64_t start, len;
+        if (!(in->reserved_2 & INODE_FLAG_EXTENTS)) { start = in->direct[k]; len = 1; }
+        else if (k < INLINE_EXTENTS) { start = in->direct[2 * k]; len = in->direct[2 * k + 1]; }
+        else { start = eb->entries[k - INLINE_EXTENTS].start; len = eb->entries[k - INLINE_EXTENTS].len; }
+
+        mvfs_group_t *g = mvfs_data_group(fs, start);
+        if (len == 0 || !g || start + len > g->data_start + g->data_blocks) return -1;
+        total += len;
+        if (count > 0 && runs[count - 1].start + runs[count - 1].len == start) {
+            runs[count - 1].len += len;
+            continue;
+        }
+        if (count == max) return -1;
+        runs[count].start = start;
+        runs[count].len = len;
+        count++;
+    }
+    if (mvfs_is_compressed(in)) return total < blocks ? count : -1;
+    return total == blocks ? count : -1;
+}
+
+const uint8_t *mvfs_packed_tail(mvfs_t *fs, const inode_t *in) {
+    uint64_t off = in->reserved_0;
+    if (in->size_bytes > PACKED_TAIL_MAX || off % PACKED_TAIL_ALIGN != 0 || off + in->size_bytes > BS) return NULL;
+    if (!mvfs_data_group(fs, in->reserved_1)) return NULL;
+    return mvfs_block(fs, in->reserved_1) + off;
+}
+
+int mvfs_shared_table_read(mvfs_t *fs, shared_ref_t **out) {
+    superblock_t *sb = fs->sb;
+    *out = NULL;
+    if (sb->shared_blocks == 0) return sb->shared_table == 0 ? 0 : -1;
+    if (sb->shared_blocks > fs->data_blocks) return -1;
+
+    shared_ref_t *refs = malloc(sb->shared_blocks * sizeof(shared_ref_t));
+    if (!refs) { perror("malloc shared table"); return -1; }
+
+    // Every table block holds at least one entry, which also bounds the chain
+    uint64_t n = 0;
+    uint64_t b = sb->shared_table;
+    int ok = 1;
+    while (ok && b != 0 && mvfs_data_group(fs, b)) {
+        const shared_table_t *st = (const shared_table_t*)mvfs_block(fs, b);
+        if (st->magic != SHARED_TABLE_MAGIC || st->count == 0 || !shared_table_crc_ok(st) ||
+            st->count > sb->shared_blocks - n) {
+            break;
+        }
+        for (uint32_t i = 0; i < st->count && ok; i++) {
+            const shared_ref_t *e = &st->entries[i];
+            ok = e->refs >= 2 && mvfs_data_group(fs, e->block) && (n == 0 || e->block > refs[n - 1].block);
+            refs[n++] = *e;
+        }
+        b = st->next;
+        if (ok && b == 0 && n == sb->shared_blocks) {
+            *out = refs;
+            return 0;
+        }
+    }
+    free(refs);
+    return -1;
+}
+
+// The `len` bytes at byte `off` of the stream held by the runs: in the mapping when they
+// lie in one run, otherwise copied to `scratch`. NULL if they go past the runs' end.
+static const uint8_t *stream_bytes(mvfs_t *fs, const mvfs_run_t *runs, int count, uint64_t off, uint64_t len, uint8_t *scratch) {
+    int k = 0;
+    while (k < count && off >= runs[k].len * BS) off -= runs[k++].len * BS;
+    if (k == count) return len == 0 ? scratch : NULL;
+    if (off + len <= runs[k].len * BS) return mvfs_block(fs, runs[k].start) + off;
+
+    uint64_t done = 0;
+    for (; k < count && done < len; k++, off = 0) {
+        uint64_t n = runs[k].len * BS - off < len - done ? runs[k].len * BS - off : len - done;
+        memcpy(scratch + done, mvfs_block(fs, runs[k].start) + off, n);
+        done += n;
+    }
+    return done == len ? scratch : NULL;
+}
+
+compress_header_t *mvfs_compress_header(mvfs_t *fs, const inode_t *in, const mvfs_run_t *runs, int count) {
+    uint64_t stored = 0;
+    for (int k = 0; k < count; k++) stored += runs[k].len;
+    uint64_t chunks = div_round_up_u64(in->size_bytes, COMPRESS_CHUNK);
+    uint64_t header_len = sizeof(compress_header_t) + chunks * sizeof(uint32_t);
+    if (header_len > stored * BS) return NULL;
+
+    compress_header_t *h = malloc(header_len);
+    if (!h) { perror("malloc compress header"); return NULL; }
+    const uint8_t *p = stream_bytes(fs, runs, count, 0, header_len, (uint8_t*)h);
+    if (p != (const uint8_t*)h) memcpy(h, p, header_len);
+
+    // The chunks must fill the blocks up to the last, with no block left over
+    int ok = h->magic == COMPRESS_MAGIC && h->chunks == chunks && h->crc == crc32(h->clen, chunks * sizeof(uint32_t));
+    uint64_t total = header_len;
+    for (uint64_t i = 0; i < chunks && ok; i++) {
+        uint64_t plain = in->size_bytes - i * COMPRESS_CHUNK < COMPRESS_CHUNK ? in->size_bytes - i * COMPRESS_CHUNK : COMPRESS_CHUNK;
+        ok = h->clen[i] > 0 && h->clen[i] <= plain;
+        total += h->clen[i];
+    }
+    if (!ok || div_round_up_u64(total, BS) != stored) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+int mvfs_file_decompress(mvfs_t *fs, const inode_t *in, int (*fn)(const uint8_t *data, size_t len, void *ctx), void *ctx) {
+    mvfs_run_t *runs = malloc(EXTENT_MAX * sizeof(*runs));
+    uint8_t *buf = malloc(2 * COMPRESS_CHUNK);     // a chunk's plain bytes, then its stored ones if they span runs
+    if (!runs || !buf) {
+        perror("malloc decompress buffers");
+        free(runs);
+        free(buf);
+        return -1;
+    }
+    int count = mvfs_is_compressed(in) ? mvfs_file_runs(fs, in, runs, EXTENT_MAX) : -1;
+    compress_header_t *h = count > 0 ? mvfs_compress_header(fs, in, runs, count) : NULL;
+    int rc = h ? 0 : -1;
+
+    uint64_t off = h ? sizeof(compress_header_t) + h->chunks * sizeof(uint32_t) : 0;
+    for (uint32_t i = 0; h && i < h->chunks && rc == 0; i++) {
+        uint64_t plain = in->size_bytes - (uint64_t)i * COMPRESS_CHUNK;
+        if (plain > COMPRESS_CHUNK) plain = COMPRESS_CHUNK;
+        const uint8_t *src = stream_bytes(fs, runs, count, off, h->clen[i], buf + COMPRESS_CHUNK);
+        off += h->clen[i];
+        if (h->clen[i] == plain) rc = fn(src, plain, ctx);
+        else if (mvfs_lz_decompress(src, h->clen[i], buf, COMPRESS_CHUNK) != (int64_t)plain) rc = -1;
+        else rc = fn(buf, plain, ctx);
+    }
+    free(h);
+    free(buf);
+    free(runs);
+    return rc;
+}
+
+// ====================== Compression ======================
+#define MVLZ_HASH_BITS 12
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - MVLZ_HASH_BITS);
+}
+
+// Bytes a length of `n` takes past its token nibble
+static inline size_t lz_length_bytes(size_t n) {
+    return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t n) {
+    for (n -= 15; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip == iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Appends one sequence, the final one when mlen is 0. NULL if it does not fit before oend.
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t ml = mlen ? mlen - MVLZ_MIN_MATCH : 0;
+    size_t need = 1 + lz_length_bytes(nlit) + nlit + (mlen ? 2 + lz_length_bytes(ml) : 0);
+    if ((size_t)(oend - op) < need) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = lz_put_length(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (ml >= 15) op = lz_put_length(op, ml);
+    return op;
+}
+
+// Greedy single-probe matching: one hash table slot per 4-byte prefix, and a stride that
+// grows the longer nothing matches, so incompressible input costs little
+size_t mvfs_lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << MVLZ_HASH_BITS];   // position + 1 of the last prefix seen, 0 if none
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    size_t anchor = 0, i = 0;
+
+    while (i + MVLZ_MIN_MATCH <= len) {
+        uint32_t v = lz_read32(src + i);
+        uint32_t h = lz_hash(v);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i + 1;
+        if (cand == 0 || i - (cand - 1) > 0xFFFFu || lz_read32(src + cand - 1) != v) {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        cand--;
+        size_t m = MVLZ_MIN_MATCH;
+        while (i + m < len && src[cand + m] == src[i + m]) m++;
+        op = lz_emit(op, oend, src + anchor, i - anchor, i - cand, m);
+        if (!op) return 0;
+        i += m;
+        anchor = i;
+    }
+    op = lz_emit(op, oend, src + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+int64_t mvfs_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + len;
+    size_t o = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_length(&ip, iend, &nlit) < 0) return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > cap - o) return -1;
+        memcpy(dst + o, ip, nlit);
+        ip += nlit;
+        o += nlit;
+        if (ip == iend) break;      // the final sequence has literals only
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t m = token & 15u;
+        if (m == 15 && lz_get_length(&ip, iend, &m) < 0) return -1;
+        m += MVLZ_MIN_MATCH;
+        if (offset == 0 || offset > o || m > cap - o) return -1;
+        // A match may overlap the bytes it produces (offset < m): copy forwards
+        if (offset >= m) {
+            memcpy(dst + o, dst + o - offset, m);
+        } else {
+            for (size_t j = 0; j < m; j++) dst[o + j] = dst[o - offset + j];
+        }
+        o += m;
+    }
+    return (int64_t)o;
+}
+
+// ====================== Directories ======================
+// FNV-1a: cheap, and only has to spread names evenly over the leaves
+uint32_t mvfs_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const uint8_t *p = (const uint8_t*)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+typedef struct {
+    int depth;                              // index blocks walked, root first
+    uint64_t block[DIR_INDEX_DEPTH_MAX];
+    uint32_t pos[DIR_INDEX_DEPTH_MAX];      // entry followed in each
+} dir_path_t;
+
+static int dir_block_ok(mvfs_t *fs, uint64_t block) {
+    return mvfs_data_group(fs, block) != NULL;
+}
+
+// Leaf that holds (or would hold) names with this hash, recording the index blocks on the
+// way in `path`; 0 if the index is corrupt. A single-block directory is its own leaf.
+static uint64_t dir_find_leaf(mvfs_t *fs, const inode_t *dir, uint32_t hash, dir_path_t *path) {
+    uint64_t block = dir->direct[0];
+    path->depth = 0;
+    if (!dir_block_ok(fs, block)) return 0;
+    if (!(dir->reserved_2 & INODE_FLAG_HASHED_DIR)) return block;
+
+    uint32_t level = 0;
+    do {
+        const dir_index_t *ix = (const dir_index_t*)mvfs_block(fs, block);
+        if (ix->magic != DIR_INDEX_MAGIC || ix->count == 0 || ix->count > DIR_INDEX_MAX ||
+            path->depth == DIR_INDEX_DEPTH_MAX || (path->depth > 0 && ix->level + 1 != level)) {
+            return 0;
+        }
+        level = ix->level;
+
+        // Last entry whose hash is <= `hash`; entries[0] is the block's lower bound
+        uint32_t lo = 0, hi = ix->count;
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ix->entries[mid].hash <= hash) lo = mid;
+            else hi = mid;
+        }
+        path->block[path->depth] = block;
+        path->pos[path->depth] = lo;
+        path->depth++;
+        block = ix->entries[lo].block;
+        if (!dir_block_ok(fs, block)) return 0;
+    } while (level > 0);
+    return block;
+}
+
+dirent64_t *mvfs_dir_lookup(mvfs_t *fs, const inode_t *dir, const char *name) {
+    dir_path_t path;
+    uint64_t leaf = dir_find_leaf(fs, dir, mvfs_name_hash(name), &path);
+    if (!leaf) return NULL;
+
+    dirent64_t *de = (dirent64_t*)mvfs_block(fs, leaf);
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (de[i].inode_no != 0 && strncmp(de[i].name, name, sizeof(de[i].name)) == 0) return &de[i];
+    }
+    return NULL;
+}
+
+static int dirent_free_slot(const dirent64_t *de) {
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (de[i].inode_no == 0) return (int)i;
+    }
+    return -1;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Hash at which a full leaf splits as evenly as its names allow: names hashing at or above
+// it move to the new leaf. 0 if every name has the same hash and the leaf cannot split.
+static uint32_t dir_leaf_split_hash(const dirent64_t *de) {
+    uint32_t h[DIRENTS_PER_BLOCK];
+    for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) h[i] = mvfs_name_hash(de[i].name);
+    qsort(h, DIRENTS_PER_BLOCK, sizeof(h[0]), cmp_u32);
+
+    for (unsigned d = 0; d < DIRENTS_PER_BLOCK / 2; d++) {
+        unsigned up = DIRENTS_PER_BLOCK / 2 + d, down = DIRENTS_PER_BLOCK / 2 - d;
+        if (h[up] != h[up - 1]) return h[up];
+        if (h[down] != h[down - 1]) return h[down];
+    }
+    return 0;   // a real split hash is above h[0], so never 0
+}
+
+// Takes `count` free data blocks for directory `dir_ino`, zeroed and marked dirty, from
+// its own group first. Returns 0, or -1 (taking none) if there are not that many.
+static int dir_alloc_blocks(mvfs_t *fs, uint32_t dir_ino, uint64_t *out, int count) {
+    uint64_t group = (uint64_t)(mvfs_inode_group(fs, dir_ino) - fs->groups);
+    for (int i = 0; i < count; i++) {
+        out[i] = fs->alloc_block ? fs->alloc_block(fs) : mvfs_alloc_block(fs, group);
+        if (out[i] == 0) {
+            while (i-- > 0) mvfs_free_block(fs, out[i]);
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        memset(mvfs_block(fs, out[i]), 0, BS);
+        mvfs_mark_dirty(fs, out[i], 1);
+    }
+    return 0;
+}
+
+// Inserts (hash, child) right after the entry path->pos[d] of index block path->block[d].
+// A full block splits in half and the new half goes into its parent the same way; a full
+// root first moves its entries into a new child, so the root never changes block.
+// *pool holds enough fresh blocks for every split on the path.
+static void dir_index_insert(mvfs_t *fs, dir_path_t *path, int d, uint32_t hash, uint64_t child, const uint64_t **pool) {
+    uint64_t block = path->block[d];
+    dir_index_t *ix = (dir_index_t*)mvfs_block(fs, block);
+    uint32_t at = path->pos[d] + 1;
+
+    if (ix->count < DIR_INDEX_MAX) {
+        memmove(&ix->entries[at + 1], &ix->entries[at], (ix->count - at) * sizeof(ix->entries[0]));
+        ix->entries[at].hash = hash;
+        ix->entries[at].block = (uint32_t)child;
+        ix->count++;
+        dir_index_crc_finalize(ix);
+        mvfs_mark_dirty(fs, block, 1);
+        return;
+    }
+
+    if (d == 0) {
+        uint64_t moved = *(*pool)++;
+        memcpy(mvfs_block(fs, moved), ix, BS);
+        memset(ix->entries, 0, sizeof(ix->entries));
+        ix->level++;
+        ix->count = 1;
+        ix->entries[0].block = (uint32_t)moved;
+        dir_index_crc_finalize(ix);
+        mvfs_mark_dirty(fs, block, 1);
+
+        memmove(&path->block[1], &path->block[0], path->depth * sizeof(path->block[0]));
+        memmove(&path->pos[1], &path->pos[0], path->depth * sizeof(path->pos[0]));
+        path->pos[0] = 0;
+        path->block[1] = moved;
+        path->depth++;
+        d = 1;
+        block = moved;
+        ix = (dir_index_t*)mvfs_block(fs, block);
+    }
+
+    // Upper half to a new sibling, then the entry into whichever half it falls in
+    uint64_t sibling = *(*pool)++;
+    dir_index_t *sx = (dir_index_t*)mvfs_block(fs, sibling);
+    uint32_t half = DIR_INDEX_MAX / 2;
+    sx->magic = DIR_INDEX_MAGIC;
+    sx->level = ix->level;
+    sx->count = ix->count - half;
+    memcpy(sx->entries, &ix->entries[half], sx->count * sizeof(ix->entries[0]));
+    memset(&ix->entries[half], 0, sx->count * sizeof(ix->entries[0]));
+    ix->count = half;
+
+    dir_index_t *into = at > half ? sx : ix;
+    if (at > half) at -= half;
+    memmove(&into->entries[at + 1], &into->entries[at], (into->count - at) * sizeof(into->entries[0]));
+    into->entries[at].hash = hash;
+    into->entries[at].block = (uint32_t)child;
+    into->count++;
+
+    dir_index_crc_finalize(ix);
+    dir_index_crc_finalize(sx);
+    mvfs_mark_dirty(fs, block, 1);
+    mvfs_mark_dirty(fs, sibling, 1);
+    dir_index_insert(fs, path, d - 1, sx->entries[0].hash, sibling, pool);
+}
+
+int mvfs_dir_add(mvfs_t *fs, uint32_t dir_ino, const char *name, uint32_t ino, uint8_t type) {
+    inode_t dir = *mvfs_inode(fs, dir_ino);
+    uint32_t hash = mvfs_name_hash(name);
+    dir_path_t path;
+    uint64_t leaf = dir_find_leaf(fs, &dir, hash, &path);
+    if (!leaf) {
+        fprintf(stderr, "Directory index of inode %u is corrupt\n", dir_ino);
+        return -1;
+    }
+
+    dirent64_t *de = (dirent64_t*)mvfs_block(fs, leaf);
+    int slot = dirent_free_slot(de);
+    if (slot < 0) {
+        uint32_t split = dir_leaf_split_hash(de);
+        if (split == 0) {
+            fprintf(stderr, "Directory leaf cannot split: all its names share one hash\n");
+            return -1;
+        }
+
+        // A new leaf, plus one block per full index block above it (two for a full root);
+        // a single-block directory needs a leaf for its old entries and one to split into
+        int hashed = (dir.reserved_2 & INODE_FLAG_HASHED_DIR) != 0;
+        int need = 2;
+        if (hashed) {
+            need = 1;
+            int d = path.depth - 1;
+            while (d >= 0 && ((dir_index_t*)mvfs_block(fs, path.block[d]))->count == DIR_INDEX_MAX) {
+                need++;
+                d--;
+            }
+            if (d < 0) {
+                if (path.depth == DIR_INDEX_DEPTH_MAX) {
+                    fprintf(stderr, "Directory index is at its maximum depth\n");
+                    return -1;
+                }
+                need++;
+            }
+        }
+        uint64_t pool[DIR_INDEX_DEPTH_MAX + 2];
+        if (dir_alloc_blocks(fs, dir_ino, pool, need) < 0) {
+            fprintf(stderr, "No free data blocks to grow the directory\n");
+            return -1;
+        }
+        const uint64_t *next = pool;
+
+        if (!hashed) {
+            // The directory block becomes the index root; its entries move to the first leaf
+            uint64_t first = *next++;
+            memcpy(mvfs_block(fs, first), de, BS);
+            dir_index_t *root = (dir_index_t*)de;
+            memset(root, 0, BS);
+            root->magic = DIR_INDEX_MAGIC;
+            root->count = 1;
+            root->entries[0].block = (uint32_t)first;
+            dir_index_crc_finalize(root);
+            mvfs_mark_dirty(fs, leaf, 1);
+
+            path.depth = 1;
+            path.block[0] = leaf;
+            path.pos[0] = 0;
+            dir.reserved_2 |= INODE_FLAG_HASHED_DIR;
+            leaf = first;
+            de = (dirent64_t*)mvfs_block(fs, leaf);
+
+            superblock_t *sb = fs->sb;
+            sb->flags |= SB_FLAG_HASHED_DIRS;
+            if (sb->version < MVSF_VERSION_HASHED_DIRS) sb->version = MVSF_VERSION_HASHED_DIRS;
+        }
+
+        uint64_t sibling = *next++;
+        dirent64_t *sd = (dirent64_t*)mvfs_block(fs, sibling);
+        unsigned moved = 0;
+        for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (mvfs_name_hash(de[i].name) >= split) {
+                sd[moved++] = de[i];
+                memset(&de[i], 0, sizeof(de[i]));
+            }
+        }
+        mvfs_mark_dirty(fs, leaf, 1);
+        dir_index_insert(fs, &path, path.depth - 1, split, sibling, &next);
+
+        if (hash >= split) {
+            leaf = sibling;
+            de = sd;
+        }
+        slot = dirent_free_slot(de);
+        dir.size_bytes += (uint64_t)need * BS;
+        mvfs_put_inode(fs, dir_ino, &dir);
+    }
+
+    dirent64_t *entry = &de[slot];
+    entry->inode_no = ino;
+    entry->type = type;
+    memset(entry->name, 0, sizeof(entry->name));
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    dirent_checksum_finalize(entry);
+    mvfs_mark_dirty(fs, leaf, 1);
+    return 0;
+}
+
+// Leaves of the index below `block` in hash order, with fn() on every used entry
+static int dir_walk(mvfs_t *fs, uint64_t block, int depth, int64_t level, int (*fn)(const dirent64_t *de, void *ctx), void *ctx) {
+    if (!dir_block_ok(fs, block)) return -1;
+    if (level < 0) {
+        const dirent64_t *de = (const dirent64_t*)mvfs_block(fs, block);
+        for (unsigned i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (de[i].inode_no == 0) continue;
+            int rc = fn(&de[i], ctx);
+            if (rc != 0) return rc;
+        }
+        return 0;
+    }
+
+    const dir_index_t *ix = (const dir_index_t*)mvfs_block(fs, block);
+    if (ix->magic != DIR_INDEX_MAGIC || ix->count == 0 || ix->count > DIR_INDEX_MAX ||
+        depth == DIR_INDEX_DEPTH_MAX || (depth > 0 && ix->level != (uint64_t)level)) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < ix->count; i++) {
+        int rc = dir_walk(fs, ix->entries[i].block, depth + 1, (int64_t)ix->level - 1, fn, ctx);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int mvfs_dir_foreach(mvfs_t *fs, const inode_t *dir, int (*fn)(const dirent64_t *de, void *ctx), void *ctx) {
+    if (!(dir->reserved_2 & INODE_FLAG_HASHED_DIR)) return dir_walk(fs, dir->direct[0], 0, -1, fn, ctx);
+    if (!dir_block_ok(fs, dir->direct[0])) return -1;
+    const dir_index_t *root = (const dir_index_t*)mvfs_block(fs, dir->direct[0]);
+    return dir_walk(fs, dir->direct[0], 0, root->level, fn, ctx);
+}
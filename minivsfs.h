@@ -0,0 +1,592 @@
+// libminivsfs: on-disk format and mmap-based image access shared by the MiniVSFS tools.
+// Build a tool together with the library, e.g.
+//   gcc -O2 -std=c17 -Wall -Wextra mkfs_adder_skeleton.c minivsfs.c -o mkfs_adder
+//
+// mvfs_open() maps the whole image MAP_SHARED and hands out typed pointers into it
+// (superblock, bitmaps, inodes, directory and data blocks). Changes made through them
+// only need the touched blocks marked with mvfs_mark_dirty(); mvfs_commit() refreshes
+// the superblock CRC and msyncs the dirty runs. File data is better moved through
+// fs->fd (copy_file_range, pwrite, or an mvfs_io_t queue), which shares the page cache
+// with the mapping; marked with mvfs_mark_data_dirty(), it is synced before any metadata.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define BS 4096u               // block size (fixed to 4096)
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define MVSF_MAGIC 0x4D565346u  // "MVSF"
+
+// superblock versions and flags
+#define MVSF_VERSION_DIRECT 1u
+#define MVSF_VERSION_EXTENTS 2u       // some inodes may use the extent layout below
+#define MVSF_VERSION_HASHED_DIRS 3u   // some directories may use the hashed layout below
+#define MVSF_VERSION_BLOCK_GROUPS 4u  // the image is split into block groups (see below)
+#define MVSF_VERSION_PACKED_TAILS 5u  // some small files share fragment blocks (see below)
+#define MVSF_VERSION_SHARED_BLOCKS 6u // some data blocks belong to several files (see below)
+#define MVSF_VERSION_COMPRESSED 7u    // some files are stored compressed (see below)
+#define SB_FLAG_LAZY_ITABLE 0x1u      // inode-table blocks >= itable_init_blocks were never written
+#define SB_FLAG_EXTENT_INODES 0x2u    // at least one inode has INODE_FLAG_EXTENTS
+#define SB_FLAG_HASHED_DIRS 0x4u      // at least one directory has INODE_FLAG_HASHED_DIR
+#define SB_FLAG_BLOCK_GROUPS 0x8u     // layout is per group, from the group descriptor table
+#define SB_FLAG_PACKED_TAILS 0x10u    // at least one inode has INODE_FLAG_PACKED_TAIL
+#define SB_FLAG_SHARED_BLOCKS 0x20u   // the shared-block table is not empty
+#define SB_FLAG_COMPRESSED 0x40u      // at least one inode has INODE_FLAG_COMPRESSED
+
+// Extent inodes (version 2). Files of more than DIRECT_MAX blocks set INODE_FLAG_EXTENTS in
+// reserved_2 and reuse the other fields:
+//   direct[2k], direct[2k+1]  start block (absolute) and length of extent k, k < INLINE_EXTENTS
+//   reserved_0                number of extents
+//   reserved_1                absolute block holding extents INLINE_EXTENTS.. (0 if none)
+// Smaller files keep the version-1 direct[] layout, so readers of either version work on them.
+#define INODE_FLAG_EXTENTS 0x1u
+#define INLINE_EXTENTS (DIRECT_MAX / 2)
+#define EXTENT_BLOCK_MAGIC 0x5845564Du  // "MVEX"
+#define EXTENT_BLOCK_MAX ((BS - 16u) / 8u)
+#define EXTENT_MAX (INLINE_EXTENTS + EXTENT_BLOCK_MAX)
+
+// Hashed directories (version 3). A directory starts as the single block direct[0]; when
+// that fills up, it becomes the root of an index keyed on mvfs_name_hash(name) and the
+// inode gets INODE_FLAG_HASHED_DIR. Index blocks hold (hash, block) pairs sorted by hash:
+// entry i takes the hashes from its own up to the next entry's, and entries[0] carries the
+// lowest hash the block covers. Level-0 index blocks point to leaves of DIRENTS_PER_BLOCK
+// ordinary dirents, level n to index blocks of level n-1. A full leaf or index block splits
+// in two by hash, so lookup and insertion read one block per level plus one leaf.
+// size_bytes counts every block of the directory.
+#define INODE_FLAG_HASHED_DIR 0x2u
+#define DIRENTS_PER_BLOCK (BS / 64u)
+#define DIR_INDEX_MAGIC 0x5844564Du     // "MVDX"
+#define DIR_INDEX_MAX ((BS - 16u) / 8u)
+#define DIR_INDEX_DEPTH_MAX 4
+
+// Block groups (version 4, built with --block-groups). After the superblock come
+// group_desc_blocks blocks of group descriptors, then group_count groups of
+// blocks_per_group blocks (the last may be shorter). Each group holds its own inode bitmap,
+// data bitmap, inode table and data region, in that order, at the blocks its descriptor
+// names. Group g owns inodes [g * inodes_per_group + 1, (g + 1) * inodes_per_group]; inode
+// and data block numbers stay absolute, so extents and dirents read the same as before.
+// The superblock's region fields describe group 0, and inode_count is the total.
+// Packed tails (version 5). A regular file of at most PACKED_TAIL_MAX bytes may be stored in
+// a fragment block shared with other small files rather than in a block of its own. Its
+// inode sets INODE_FLAG_PACKED_TAIL in reserved_2, leaves direct[] zero and reuses:
+//   reserved_1   absolute block number of the fragment block
+//   reserved_0   byte offset of the data in it, a multiple of PACKED_TAIL_ALIGN
+// size_bytes is the length. Fragments never overlap or cross the end of their block. The
+// superblock's tail_block is the fragment block being filled (0 if none): its bytes from
+// tail_used on are free. Other fragment blocks are referenced only from inodes.
+#define INODE_FLAG_PACKED_TAIL 0x4u
+#define PACKED_TAIL_MAX (BS / 2u)
+#define PACKED_TAIL_ALIGN 16u
+
+// Shared blocks (version 6, from the adder's --dedup). A data block whose contents several
+// files have in common may be named by all of their block maps. Every such block has an
+// entry in the shared-block table with its reference count (at least 2); blocks not in it
+// have one owner, as before. The table is a chain of shared_table_t blocks starting at the
+// superblock's shared_table, entries sorted by block across the chain, shared_blocks of them.
+#define SHARED_TABLE_MAGIC 0x5253564Du  // "MVSR"
+#define SHARED_TABLE_MAX ((BS - 16u) / 8u)
+
+// Compressed files (version 7, from the adder's --compress). A regular file whose data
+// compresses sets INODE_FLAG_COMPRESSED in reserved_2, always uses the extent layout, and
+// its blocks hold a stream rather than the bytes themselves: a compress_header_t, then
+// each COMPRESS_CHUNK bytes of the file (the last chunk may be shorter) in clen[i] bytes,
+// back to back. A chunk whose clen equals its plain length is stored as is, a shorter one
+// in the MVLZ format of mvfs_lz_compress(). size_bytes is the plain length; the extents
+// cover the stream, zero-padded to a whole block, and are fewer blocks than it would take.
+#define INODE_FLAG_COMPRESSED 0x8u
+#define COMPRESS_MAGIC 0x5A4C564Du      // "MVLZ"
+#define COMPRESS_CHUNK (64u * 1024u)
+
+#define GROUP_DESC_SIZE 64u
+#define GROUP_DESCS_PER_BLOCK (BS / GROUP_DESC_SIZE)
+#define DEFAULT_BLOCKS_PER_GROUP (BS * 8u)  // one data bitmap block per group
+
+// ====================== Superblock ======================
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;               // 0x4D565346 "MVSF"
+    uint32_t version;             // MVSF_VERSION_*
+    uint32_t block_size;          // 4096
+    uint64_t total_blocks;        // total blocks in the image
+    uint64_t inode_count;         // total inodes
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;          // 1
+    uint64_t mtime_epoch;         // build time
+    uint32_t flags;               // SB_FLAG_* bits
+    uint32_t checksum;            // crc32(superblock[0..4091])
+    // Fields below are still inside the CRC'd 4092 bytes; older images have them as 0
+    uint64_t itable_init_blocks;  // with SB_FLAG_LAZY_ITABLE: inode-table blocks [0, n) are written
+    uint64_t inode_cursor;        // next-fit hint: inode bitmap bit to resume searching at
+    uint64_t data_cursor;         // next-fit hint: data bitmap bit to resume searching at
+    // With SB_FLAG_BLOCK_GROUPS (otherwise 0)
+    uint64_t group_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t group_desc_start;
+    uint64_t group_desc_blocks;
+    // Packed tails: the fragment block being filled (0 if none) and the bytes used in it
+    uint64_t tail_block;
+    uint64_t tail_used;
+    // Shared blocks: first block of the table (0 if none) and its number of entries
+    uint64_t shared_table;
+    uint64_t shared_blocks;
+} superblock_t;
+#pragma pack(pop)
+
+// ====================== Inode (128 bytes) ======================
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;          // file/dir mode bits (type encoded: 0100000 file, 0040000 dir)
+    uint16_t links;         // link count
+    uint32_t uid;           // owner uid
+    uint32_t gid;           // owner gid
+    uint64_t size_bytes;    // logical size
+    uint64_t atime;         // access time (epoch)
+    uint64_t mtime;         // modification time (epoch)
+    uint64_t ctime;         // change time (epoch)
+    uint32_t direct[12];    // absolute data block numbers
+    uint32_t reserved_0;    // 0
+    uint32_t reserved_1;    // 0
+    uint32_t reserved_2;    // 0
+    uint32_t proj_id;       // group/project id (set to gid or 0)
+    uint32_t uid16_gid16;   // 0
+    uint64_t xattr_ptr;     // 0
+    uint64_t inode_crc;     // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// ====================== Dirent (64 bytes) ======================
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;      // 0 if free
+    uint8_t  type;          // 1=file, 2=dir
+    char     name[58];      // NUL-terminated if shorter
+    uint8_t  checksum;      // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+// ====================== Extent overflow block ======================
+#pragma pack(push,1)
+typedef struct {
+    uint32_t start;         // absolute block number
+    uint32_t len;           // blocks
+} extent_t;
+
+typedef struct {
+    uint32_t magic;         // EXTENT_BLOCK_MAGIC
+    uint32_t count;         // entries used
+    uint32_t crc;           // crc32 of entries[0..count)
+    uint32_t reserved;      // 0
+    extent_t entries[EXTENT_BLOCK_MAX];
+} extent_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_block_t)==BS, "extent block size mismatch");
+
+// ====================== Directory index block ======================
+#pragma pack(push,1)
+typedef struct {
+    uint32_t hash;          // lowest name hash routed to `block`
+    uint32_t block;         // absolute block number
+} dir_index_entry_t;
+
+typedef struct {
+    uint32_t magic;         // DIR_INDEX_MAGIC
+    uint32_t count;         // entries used, at least 1
+    uint32_t crc;           // crc32 of entries[0..count)
+    uint32_t level;         // 0: entries point to dirent leaves, n: to level n-1 index blocks
+    dir_index_entry_t entries[DIR_INDEX_MAX];
+} dir_index_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dir_index_t)==BS, "directory index size mismatch");
+
+// ====================== Shared-block table block ======================
+#pragma pack(push,1)
+typedef struct {
+    uint32_t block;         // absolute block number
+    uint32_t refs;          // block maps naming it, at least 2
+} shared_ref_t;
+
+typedef struct {
+    uint32_t magic;         // SHARED_TABLE_MAGIC
+    uint32_t count;         // entries used
+    uint32_t crc;           // crc32 of entries[0..count)
+    uint32_t next;          // absolute block of the next table block, 0 for the last
+    shared_ref_t entries[SHARED_TABLE_MAX];
+} shared_table_t;
+#pragma pack(pop)
+_Static_assert(sizeof(shared_table_t)==BS, "shared table block size mismatch");
+
+// ====================== Compressed stream header ======================
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;         // COMPRESS_MAGIC
+    uint32_t chunks;        // size_bytes / COMPRESS_CHUNK, rounded up
+    uint32_t crc;           // crc32 of clen[0..chunks)
+    uint32_t reserved;      // 0
+    uint32_t clen[];        // stored bytes of each chunk
+} compress_header_t;
+#pragma pack(pop)
+
+// ====================== Group descriptor (64 bytes) ======================
+// Naturally aligned, so the free counts can be updated atomically in place
+typedef struct {
+    uint64_t inode_bitmap_start;
+    uint64_t data_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t data_region_start;
+    uint64_t data_cursor;         // next-fit hint: bit of this group's data bitmap
+    uint32_t data_region_blocks;
+    uint32_t free_blocks;         // clear bits in the data bitmap
+    uint32_t free_inodes;         // clear bits in the inode bitmap
+    uint32_t itable_init_blocks;  // with SB_FLAG_LAZY_ITABLE: inode-table blocks [0, n) are written
+    uint32_t reserved;            // 0
+    uint32_t checksum;            // crc32(descriptor[0..59])
+} group_desc_t;
+_Static_assert(sizeof(group_desc_t)==GROUP_DESC_SIZE, "group descriptor size mismatch");
+
+// ====================== Checksums ======================
+// Call once before any of the finalize functions (builds the CRC tables)
+void mvfs_init(void);
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+// `sb` must point to a full 4096-byte block image.
+uint32_t superblock_crc_finalize(superblock_t *sb);
+// WARNING: CALL THIS ONLY AFTER ALL OTHER INODE ELEMENTS HAVE BEEN FINALIZED
+void inode_crc_finalize(inode_t *ino);
+// WARNING: CALL THIS ONLY AFTER ALL OTHER DIRENT ELEMENTS HAVE BEEN FINALIZED
+void dirent_checksum_finalize(dirent64_t *de);
+void extent_block_crc_finalize(extent_block_t *eb);
+void dir_index_crc_finalize(dir_index_t *ix);
+void group_desc_crc_finalize(group_desc_t *gd);
+void shared_table_crc_finalize(shared_table_t *st);
+void compress_header_crc_finalize(compress_header_t *h);
+
+int superblock_crc_ok(const superblock_t *sb);
+int inode_crc_ok(const inode_t *ino);
+int dirent_checksum_ok(const dirent64_t *de);
+// Bit i set when dirent i of a DIRENTS_PER_BLOCK block is in use and fails its checksum
+// (AVX2 when the CPU has it)
+uint64_t dirent_block_checksums_bad(const dirent64_t *block);
+int extent_block_crc_ok(const extent_block_t *eb);
+int dir_index_crc_ok(const dir_index_t *ix);
+int group_desc_crc_ok(const group_desc_t *gd);
+int shared_table_crc_ok(const shared_table_t *st);
+
+// ====================== Bitmaps ======================
+static inline uint64_t div_round_up_u64(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+static inline void set_bit(uint8_t *bitmap, uint64_t bit_index) {
+    bitmap[bit_index >> 3u] |= (uint8_t)(1u << (bit_index & 7u));
+}
+
+static inline void clear_bit(uint8_t *bitmap, uint64_t bit_index) {
+    bitmap[bit_index >> 3u] &= (uint8_t)~(1u << (bit_index & 7u));
+}
+
+static inline int test_bit(const uint8_t *bitmap, uint64_t bit_index) {
+    return (bitmap[bit_index >> 3u] & (1u << (bit_index & 7u))) != 0;
+}
+
+// Index of the first clear (set) bit in [from, to), or `to` if there is none. Bitmaps
+// must be whole blocks; they are read 64 bits at a time (AVX2 over long uniform runs).
+uint64_t scan_clear_bit(const uint8_t *bitmap, uint64_t from, uint64_t to);
+uint64_t scan_set_bit(const uint8_t *bitmap, uint64_t from, uint64_t to);
+// Next-fit: first clear bit at or after `cursor`, wrapping around to the start once; nbits if full
+uint64_t find_clear_bit(const uint8_t *bitmap, uint64_t nbits, uint64_t cursor);
+
+// ====================== Statistics ======================
+// Counters behind the tools' --stats=json. The library counts its own I/O syscalls (pwrite,
+// pread, io_uring_enter, msync) and the bytes they move; a tool adds its own calls with
+// mvfs_count_io() and charges wall time to phases with mvfs_stats_add(). Updated from any
+// thread, so phases run by several workers add up to more than the wall time. Metadata
+// written back through the mapping counts as the bytes msync covers.
+enum {
+    MVFS_PHASE_LAYOUT,          // sizing, mapping and validating the image
+    MVFS_PHASE_BITMAP_LOAD,     // reading bitmaps, group descriptors and other tables in
+    MVFS_PHASE_ALLOCATION,      // choosing inodes and blocks, building inodes and dirents
+    MVFS_PHASE_DATA_COPY,       // moving file (or inode table) bytes into the image
+    MVFS_PHASE_WRITEBACK,       // syncing dirty metadata and data to disk
+    MVFS_PHASE_COUNT
+};
+
+typedef struct {
+    uint64_t phase_ns[MVFS_PHASE_COUNT];
+    uint64_t io_calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} mvfs_stats_t;
+
+extern mvfs_stats_t mvfs_stats;
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t mvfs_now_ns(void);
+
+static inline void mvfs_count_io(uint64_t calls, uint64_t read, uint64_t written) {
+    __atomic_add_fetch(&mvfs_stats.io_calls, calls, __ATOMIC_RELAXED);
+    if (read) __atomic_add_fetch(&mvfs_stats.bytes_read, read, __ATOMIC_RELAXED);
+    if (written) __atomic_add_fetch(&mvfs_stats.bytes_written, written, __ATOMIC_RELAXED);
+}
+
+static inline void mvfs_stats_add(int phase, uint64_t ns) {
+    __atomic_add_fetch(&mvfs_stats.phase_ns[phase], ns, __ATOMIC_RELAXED);
+}
+
+// Writes the counters as one line of JSON, with the tool's name, the files it stored and
+// their total size, its wall time and the process's peak RSS
+void mvfs_stats_print_json(FILE *out, const char *tool, uint64_t files, uint64_t file_bytes, uint64_t wall_ns);
+
+// ====================== I/O queue ======================
+// Writes to the image, and the source reads that feed them, can go through an io_uring
+// instance set up with raw syscalls: up to `depth` requests in flight from `depth` buffers
+// of MVFS_IO_BUFFER_BYTES, registered with the kernel when RLIMIT_MEMLOCK allows. A copy is
+// a read linked to the write of the same buffer. The synchronous backend does each request
+// with pread/pwrite as it is queued, so callers look the same either way. Results are
+// collected by mvfs_io_wait(). A queue belongs to one thread.
+#define MVFS_IO_BUFFER_BYTES (256u * 1024u)
+#define MVFS_IO_DEPTH 16
+enum { MVFS_IO_AUTO, MVFS_IO_SYNC, MVFS_IO_URING };
+
+typedef struct mvfs_io {
+    int fd;                 // the image
+    int ring_fd;            // -1 for the synchronous backend
+    int fixed;              // buffers are registered: *_FIXED opcodes
+    int result;             // worst outcome since the last mvfs_io_wait()
+    unsigned depth;         // buffers
+    unsigned entries;       // submission slots; also the most requests in flight
+    unsigned queued;        // prepared, not submitted yet
+    unsigned in_flight;     // submitted, not reaped yet
+    uint8_t *buffers;       // depth * MVFS_IO_BUFFER_BYTES
+    uint32_t *refs;         // per buffer: holders plus requests using it
+    uint32_t *free_buffers; // stack of buffers with no references
+    uint32_t free_count;
+    void *ops;              // per submission slot: what the request was, for its completion
+    uint32_t *free_ops;
+    uint32_t free_op_count;
+    // Rings, mapped from the io_uring fd
+    void *sq_ring, *cq_ring, *sqes;
+    size_t sq_ring_bytes, cq_ring_bytes, sqes_bytes;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+} mvfs_io_t;
+
+// Sets up a queue on the image fd. MVFS_IO_AUTO takes io_uring when the kernel allows it
+// and the synchronous backend otherwise. Returns 0, or -1 with a message.
+int mvfs_io_init(mvfs_io_t *io, int fd, int backend, unsigned depth);
+void mvfs_io_close(mvfs_io_t *io);
+// A buffer to fill and pass to mvfs_io_write() any number of times, then to
+// mvfs_io_release(); waits for one when all are in use
+uint8_t *mvfs_io_buffer(mvfs_io_t *io);
+void mvfs_io_release(mvfs_io_t *io, uint8_t *buf);
+// Queues a write of `len` bytes (at most MVFS_IO_BUFFER_BYTES) of a buffer from mvfs_io_buffer()
+void mvfs_io_write(mvfs_io_t *io, const uint8_t *buf, size_t len, uint64_t off);
+// Queues a copy of `len` bytes (at most MVFS_IO_BUFFER_BYTES) of src_fd at src_off to the
+// image at dst_off
+void mvfs_io_copy(mvfs_io_t *io, int src_fd, uint64_t src_off, size_t len, uint64_t dst_off);
+// Queues a datasync of image bytes [off, off + len); with `after`, it starts only once
+// everything queued before it has completed. io_uring only (see mvfs_commit()).
+void mvfs_io_sync(mvfs_io_t *io, uint64_t off, uint64_t len, int after);
+// Waits for everything queued. Returns 0, 1 if a copy's source read failed or came up
+// short, -1 if a write or sync failed; each failure is reported once on stderr.
+int mvfs_io_wait(mvfs_io_t *io);
+
+static inline int mvfs_io_async(const mvfs_io_t *io) {
+    return io->ring_fd >= 0;
+}
+
+// ====================== Mapped image ======================
+// One block group as the tools see it. An image without block groups is a single group
+// made of the superblock's regions, so the same code allocates on both layouts.
+typedef struct {
+    group_desc_t *desc;           // in the mapping; NULL without block groups
+    uint64_t first_ino;           // inode number of inode bitmap bit 0
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_start;          // block of data bitmap bit 0
+    uint64_t data_blocks;
+    uint64_t *data_cursor;        // the descriptor's, or the superblock's without groups
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+} mvfs_group_t;
+
+typedef struct mvfs {
+    int fd;
+    int writable;
+    uint8_t *base;          // the whole image, MAP_SHARED
+    uint64_t blocks;        // image size in blocks
+    uint8_t *dirty;         // MVFS_DIRTY_* per block, for mvfs_commit()
+    superblock_t *sb;       // set by mvfs_load(), with the fields below
+    mvfs_group_t *groups;
+    uint64_t group_count;
+    uint64_t inodes_per_group;
+    uint64_t data_blocks;   // in all groups
+    // Where the library takes data blocks for directories from; NULL means
+    // mvfs_alloc_block(). Returns an absolute block it has already marked used, or 0.
+    uint64_t (*alloc_block)(struct mvfs *fs);
+    void *alloc_ctx;
+    // Queue mvfs_commit() syncs through when it is io_uring; otherwise dirty runs are msynced
+    mvfs_io_t *io;
+    uint64_t pinned;        // bytes locked by mvfs_pin()
+} mvfs_t;
+
+// Maps an open image without looking at its contents (the builder fills it in first)
+int mvfs_map(mvfs_t *fs, int fd, int writable);
+// Checks the superblock and sets the typed region pointers
+int mvfs_load(mvfs_t *fs);
+// open + map + load
+int mvfs_open(mvfs_t *fs, const char *path, int writable);
+// Refreshes the superblock and group descriptor CRCs and syncs every dirty block: data
+// first, then metadata, so nothing on disk points at blocks that are not there yet
+int mvfs_commit(mvfs_t *fs);
+void mvfs_close(mvfs_t *fs);
+
+// The page cache behind the mapping is the block cache: a block read once is not fetched
+// again, and dirty tracking above decides what gets written back. Pinning only decides what
+// memory pressure may not evict. mvfs_pin() locks blocks of the mapping in memory as long as
+// fs->pinned stays within `budget` bytes; it returns 0, or -1 if the range was left
+// unpinned (callers carry on either way). mvfs_close() drops every pin.
+int mvfs_pin(mvfs_t *fs, uint64_t block, uint64_t count, uint64_t budget);
+void mvfs_unpin(mvfs_t *fs, uint64_t block, uint64_t count);
+// Pins what every update touches, most used first, until `budget` bytes are locked: the
+// superblock and group descriptors, the root inode's table block, the root directory's
+// first block, then each group's bitmaps. Returns the bytes pinned.
+uint64_t mvfs_pin_metadata(mvfs_t *fs, uint64_t budget);
+#define MVFS_PIN_BUDGET_DEFAULT (16u << 20)
+
+static inline uint8_t *mvfs_block(mvfs_t *fs, uint64_t block) {
+    return fs->base + block * BS;
+}
+
+#define MVFS_DIRTY_META 0x1u   // changed through the mapping
+#define MVFS_DIRTY_DATA 0x2u   // file data: written through fs->fd, or packed tails in the mapping
+
+static inline void mvfs_mark_dirty(mvfs_t *fs, uint64_t block, uint64_t count) {
+    for (uint64_t b = block; b < block + count && b < fs->blocks; b++) fs->dirty[b] |= MVFS_DIRTY_META;
+}
+
+// For blocks written through fs->fd. Workers may mark their own blocks concurrently.
+static inline void mvfs_mark_data_dirty(mvfs_t *fs, uint64_t block, uint64_t count) {
+    for (uint64_t b = block; b < block + count && b < fs->blocks; b++) fs->dirty[b] |= MVFS_DIRTY_DATA;
+}
+
+// Marks the bitmap blocks holding bits [first_bit, first_bit + count) of a bitmap starting at `start`
+static inline void mvfs_mark_bits_dirty(mvfs_t *fs, uint64_t start, uint64_t first_bit, uint64_t count) {
+    if (count == 0) return;
+    uint64_t lo = first_bit / (BS * 8u), hi = (first_bit + count - 1) / (BS * 8u);
+    mvfs_mark_dirty(fs, start + lo, hi - lo + 1);
+}
+
+static inline mvfs_group_t *mvfs_inode_group(mvfs_t *fs, uint32_t ino) {
+    return &fs->groups[(ino - 1) / fs->inodes_per_group];
+}
+
+// Group whose data region holds `block`, or NULL
+mvfs_group_t *mvfs_data_group(mvfs_t *fs, uint64_t block);
+
+// Inode `ino` inside the mapping (a hole past the lazy-table mark reads as all zeros)
+static inline inode_t *mvfs_inode(mvfs_t *fs, uint32_t ino) {
+    mvfs_group_t *g = mvfs_inode_group(fs, ino);
+    return (inode_t*)(fs->base + g->inode_table_start * BS) + (ino - g->first_ino);
+}
+
+// Adjusts a group's free counts. Atomic: parallel ingest workers share descriptors.
+static inline void mvfs_group_count(mvfs_group_t *g, int64_t inodes, int64_t blocks) {
+    if (!g->desc) return;
+    if (inodes) __atomic_add_fetch(&g->desc->free_inodes, (uint32_t)inodes, __ATOMIC_RELAXED);
+    if (blocks) __atomic_add_fetch(&g->desc->free_blocks, (uint32_t)blocks, __ATOMIC_RELAXED);
+}
+
+// Next-fit allocation of one data block, preferring group `group` and moving on to the
+// following ones; marks it used and dirty. Returns the absolute block, 0 if all are full.
+uint64_t mvfs_alloc_block(mvfs_t *fs, uint64_t group);
+// Gives back a block taken with mvfs_alloc_block()
+void mvfs_free_block(mvfs_t *fs, uint64_t block);
+
+// Fills one inode-table block with CRC'd empty inodes; slots past `inode_count` (the
+// inodes its table holds) stay zero
+void mvfs_empty_inode_block(uint64_t inode_count, uint64_t table_block, uint8_t *block);
+
+// Finalizes the inode's CRC and stores it, initializing lazily built table blocks up to its own
+void mvfs_put_inode(mvfs_t *fs, uint32_t ino, inode_t *in);
+
+// A run of consecutive data blocks (absolute block numbers)
+typedef struct {
+    uint64_t start;
+    uint64_t len;
+} mvfs_run_t;
+
+// A regular file's blocks in file order, adjacent ones merged into one run. Returns the
+// number of runs (at most `max`; EXTENT_MAX always suffices), or -1 if the block map is
+// corrupt or does not cover size_bytes (a compressed file's: fewer blocks than that).
+// Packed files have no block map; see below.
+int mvfs_file_runs(mvfs_t *fs, const inode_t *in, mvfs_run_t *runs, int max);
+
+static inline int mvfs_is_packed(const inode_t *in) {
+    return (in->reserved_2 & INODE_FLAG_PACKED_TAIL) != 0;
+}
+
+// A packed file's size_bytes bytes inside its fragment block, or NULL if they are not
+// within one data block
+const uint8_t *mvfs_packed_tail(mvfs_t *fs, const inode_t *in);
+
+// The shared-block table's entries, in block order, as a new array of sb->shared_blocks
+// (the caller frees it; NULL when the table is empty). Returns 0, or -1 if the chain or
+// its entries are corrupt.
+int mvfs_shared_table_read(mvfs_t *fs, shared_ref_t **out);
+
+static inline int mvfs_is_compressed(const inode_t *in) {
+    return (in->reserved_2 & INODE_FLAG_COMPRESSED) != 0;
+}
+
+// A compressed file's stream header, copied out of its runs (from mvfs_file_runs()) as a
+// new allocation the caller frees, or NULL if it is corrupt or does not match size_bytes
+// and the blocks the runs cover
+compress_header_t *mvfs_compress_header(mvfs_t *fs, const inode_t *in, const mvfs_run_t *runs, int count);
+// Calls fn() with a compressed file's bytes in order, at most COMPRESS_CHUNK at a time,
+// until it returns nonzero. Returns 0, fn()'s nonzero result, or -1 if the stream is corrupt.
+int mvfs_file_decompress(mvfs_t *fs, const inode_t *in, int (*fn)(const uint8_t *data, size_t len, void *ctx), void *ctx);
+
+// ====================== Compression ======================
+// MVLZ, a byte-oriented LZ77 in the LZ4 mould. Each sequence is a token (high nibble:
+// literal count, low nibble: match length - MVLZ_MIN_MATCH; 15 means more length bytes
+// follow, each adding up to 255), the literals, then a 16-bit little-endian offset back
+// into the output and the extra match length bytes. The final sequence has literals only.
+#define MVLZ_MIN_MATCH 4u
+// Compresses `len` bytes (at most COMPRESS_CHUNK) into dst. Returns the compressed length,
+// or 0 if it would not fit in `cap` bytes.
+size_t mvfs_lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+// Decompresses into dst. Returns the plain length, or -1 if the input is corrupt or would
+// not fit in `cap` bytes.
+int64_t mvfs_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+// ====================== Directories ======================
+uint32_t mvfs_name_hash(const char *name);
+// Entry for `name` in directory `dir`, or NULL if there is none (or the index is corrupt)
+dirent64_t *mvfs_dir_lookup(mvfs_t *fs, const inode_t *dir, const char *name);
+// Adds `name` -> `ino`, which must not be in the directory yet. Full blocks are split with
+// fresh data blocks (see alloc_block). Returns 0, or -1 with a message if the
+// directory cannot take the entry (no free blocks, corrupt index); nothing changes then.
+int mvfs_dir_add(mvfs_t *fs, uint32_t dir_ino, const char *name, uint32_t ino, uint8_t type);
+// Calls fn() on every used entry, leaf by leaf in hash order, until it returns nonzero.
+// Returns 0, fn()'s nonzero result, or -1 if the index is corrupt.
+int mvfs_dir_foreach(mvfs_t *fs, const inode_t *dir, int (*fn)(const dirent64_t *de, void *ctx), void *ctx);
+
+#endif
@@ -1,4 +1,5 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_minivsfs_final.c -o mkfs_minivsfs
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_minivsfs_final.c minivsfs.c -o mkfs_minivsfs
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,117 +12,270 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
-#define BS 4096u               // block size (fixed to 4096)
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-
-// =============================== CRC32 (as provided) ===============================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+#include "minivsfs.h"
+
+#define ITABLE_CHUNK_BYTES (64u * 1024u)   // one buffer of empty inodes, repeated by every iovec
+#define ITABLE_IOV_MAX 256                 // iovecs per pwritev => 16 MiB per call
+#define MAX_THREADS 64
+#define ITABLE_WORKER_IO_DEPTH 4           // each extra --threads worker has its own, smaller I/O queue
+
+// ====================== Inode table writer ======================
+// Every slot but the root is the same empty inode, so one buffer of them is
+// built (and CRC'd) once and handed to pwritev many times over.
+typedef struct {
+    int fd;
+    const uint8_t *chunk;   // ITABLE_CHUNK_BYTES of empty inodes
+    off_t offset;           // byte offset of this slice in the image
+    uint64_t length;        // bytes to write
+    int err;                // errno of the failing call, 0 on success
+} itable_slice_t;
+
+static void *write_itable_slice(void *arg) {
+    itable_slice_t *sl = (itable_slice_t*)arg;
+    off_t off = sl->offset;
+    uint64_t left = sl->length;
+
+    while (left > 0) {
+        struct iovec iov[ITABLE_IOV_MAX];
+        int n = 0;
+        uint64_t queued = 0;
+        // A short write can stop mid-inode; restart the pattern at the same phase
+        uint64_t phase = (uint64_t)(off - sl->offset) % INODE_SIZE;
+        while (n < ITABLE_IOV_MAX && queued < left) {
+            uint64_t len = ITABLE_CHUNK_BYTES - (n == 0 ? phase : 0);
+            if (len > left - queued) len = left - queued;
+            iov[n].iov_base = (void*)(sl->chunk + (n == 0 ? phase : 0));
+            iov[n].iov_len = len;
+            queued += len;
+            n++;
+        }
+
+        ssize_t w = pwritev(sl->fd, iov, n, off);
+        mvfs_count_io(1, 0, w > 0 ? (uint64_t)w : 0);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            sl->err = errno;
+            return NULL;
+        }
+        if (w == 0) { sl->err = EIO; return NULL; }
+        off += w;
+        left -= (uint64_t)w;
+    }
+    return NULL;
+}
+
+// Writes empty inodes for slots [first, count) of the table, split over `threads` workers
+static int write_empty_inodes(int fd, uint64_t table_start, uint64_t first, uint64_t count, int threads) {
+    if (first >= count) return 0;
+
+    uint8_t *chunk = (uint8_t*)malloc(ITABLE_CHUNK_BYTES);
+    if (!chunk) { perror("malloc inode chunk"); return -1; }
+    inode_t empty; memset(&empty, 0, sizeof(empty));
+    inode_crc_finalize(&empty);
+    for (uint32_t i = 0; i < ITABLE_CHUNK_BYTES / INODE_SIZE; ++i) memcpy(chunk + i * INODE_SIZE, &empty, INODE_SIZE);
+
+    uint64_t slots = count - first;
+    if (threads < 1) threads = 1;
+    if ((uint64_t)threads > slots) threads = (int)slots;
+
+    itable_slice_t slices[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    uint64_t per = slots / (uint64_t)threads;
+    for (int t = 0; t < threads; ++t) {
+        uint64_t lo = first + per * (uint64_t)t;
+        uint64_t hi = (t == threads - 1) ? count : lo + per;
+        slices[t].fd = fd;
+        slices[t].chunk = chunk;
+        slices[t].offset = (off_t)(table_start * BS + lo * INODE_SIZE);
+        slices[t].length = (hi - lo) * INODE_SIZE;
+        slices[t].err = 0;
+    }
+
+    // Slice 0 runs on this thread
+    int started = 0;
+    for (int t = 1; t < threads; ++t) {
+        if (pthread_create(&tids[t], NULL, write_itable_slice, &slices[t]) != 0) break;
+        started = t;
+    }
+    for (int t = started + 1; t < threads; ++t) write_itable_slice(&slices[t]);
+    write_itable_slice(&slices[0]);
+    for (int t = 1; t <= started; ++t) pthread_join(tids[t], NULL);
+
+    free(chunk);
+    for (int t = 0; t < threads; ++t) {
+        if (slices[t].err) { errno = slices[t].err; perror("write empty inodes"); return -1; }
+    }
+    return 0;
+}
+
+// Same, through io_uring queues, for every group's table at once: the bytes of `ranges`,
+// taken in order, are split over `threads` workers. The first runs on this thread with
+// `io`; each other one sets up its own queue, so that happens once however many groups
+// there are. A worker keeps its queue's writes of a single buffer of empty inodes in flight.
+typedef struct {
+    uint64_t offset;            // byte offset of the first slot to write
+    uint64_t length;            // bytes, a whole number of slots
+} itable_range_t;
+
+typedef struct {
+    int fd;
+    mvfs_io_t *io;              // NULL: set up a queue of its own
+    const itable_range_t *ranges;
+    size_t range_count;
+    uint64_t skip;              // bytes of the ranges before this worker's share
+    uint64_t length;            // bytes in this worker's share
+    int err;
+} itable_share_t;
+
+static void *write_itable_share(void *arg) {
+    itable_share_t *sh = (itable_share_t*)arg;
+    mvfs_io_t own, *io = sh->io;
+    if (!io) {
+        if (mvfs_io_init(&own, sh->fd, MVFS_IO_AUTO, ITABLE_WORKER_IO_DEPTH) < 0) { sh->err = 1; return NULL; }
+        io = &own;
+    }
+
+    uint8_t *chunk = mvfs_io_buffer(io);
+    inode_t empty; memset(&empty, 0, sizeof(empty));
+    inode_crc_finalize(&empty);
+    for (uint32_t i = 0; i < MVFS_IO_BUFFER_BYTES / INODE_SIZE; ++i) memcpy(chunk + i * INODE_SIZE, &empty, INODE_SIZE);
+
+    // Every write starts on a slot boundary, so the pattern always lines up
+    uint64_t skip = sh->skip, left = sh->length;
+    for (size_t r = 0; r < sh->range_count && left > 0; ++r) {
+        uint64_t len = sh->ranges[r].length;
+        if (skip >= len) { skip -= len; continue; }
+        uint64_t off = sh->ranges[r].offset + skip;
+        len -= skip;
+        skip = 0;
+        if (len > left) len = left;
+        left -= len;
+        while (len > 0) {
+            size_t n = len > MVFS_IO_BUFFER_BYTES ? MVFS_IO_BUFFER_BYTES : (size_t)len;
+            mvfs_io_write(io, chunk, n, off);
+            off += n;
+            len -= n;
+        }
     }
+    mvfs_io_release(io, chunk);
+    if (mvfs_io_wait(io) != 0) sh->err = 1;
+    if (io == &own) mvfs_io_close(&own);
+    return NULL;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+
+static int write_empty_inodes_queued(mvfs_io_t *io, const itable_range_t *ranges, size_t range_count, int threads) {
+    uint64_t slots = 0;
+    for (size_t r = 0; r < range_count; ++r) slots += ranges[r].length / INODE_SIZE;
+    if (slots == 0) return 0;
+    if (threads < 1) threads = 1;
+    if ((uint64_t)threads > slots) threads = (int)slots;
+
+    itable_share_t shares[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    uint64_t per = slots / (uint64_t)threads;
+    for (int t = 0; t < threads; ++t) {
+        shares[t].fd = io->fd;
+        shares[t].io = t == 0 ? io : NULL;
+        shares[t].ranges = ranges;
+        shares[t].range_count = range_count;
+        shares[t].skip = per * (uint64_t)t * INODE_SIZE;
+        shares[t].length = ((t == threads - 1) ? slots - per * (uint64_t)t : per) * INODE_SIZE;
+        shares[t].err = 0;
+    }
+
+    // Share 0 runs on this thread, with its queue
+    int started = 0;
+    for (int t = 1; t < threads; ++t) {
+        if (pthread_create(&tids[t], NULL, write_itable_share, &shares[t]) != 0) break;
+        started = t;
+    }
+    for (int t = started + 1; t < threads; ++t) write_itable_share(&shares[t]);
+    write_itable_share(&shares[0]);
+    for (int t = 1; t <= started; ++t) pthread_join(tids[t], NULL);
+
+    // Failures were reported by the queues
+    for (int t = 0; t < threads; ++t) {
+        if (shares[t].err) return -1;
+    }
+    return 0;
 }
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-// This function expects that `sb` points to a full 4096-byte block image whose first
-// bytes contain the superblock struct and the rest are zero.
-#pragma pack(push,1)
+
+// ====================== Layout ======================
 typedef struct {
-    uint32_t magic;             // 0x4D565346 "MVSF"
-    uint32_t version;           // 1
-    uint32_t block_size;        // 4096
-    uint64_t total_blocks;      // total blocks in the image
-    uint64_t inode_count;       // total inodes
-    uint64_t inode_bitmap_start;
     uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
     uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
     uint64_t inode_table_blocks;
-    uint64_t data_region_start;
     uint64_t data_region_blocks;
-    uint64_t root_inode;        // 1
-    uint64_t mtime_epoch;       // build time
-    uint32_t flags;             // 0
-    uint32_t checksum;          // CRC32 over first 4092 bytes of the block
-} superblock_t;
-#pragma pack(pop)
-
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
+} region_layout_t;
 
-// ====================== Inode (128 bytes) ======================
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;          // file/dir mode bits (type encoded: 0100000 file, 0040000 dir)
-    uint16_t links;         // link count
-    uint32_t uid;           // owner uid
-    uint32_t gid;           // owner gid
-    uint64_t size_bytes;    // logical size
-    uint64_t atime;         // access time (epoch)
-    uint64_t mtime;         // modification time (epoch)
-    uint64_t ctime;         // change time (epoch)
-    uint32_t direct[12];    // absolute data block numbers
-    uint32_t reserved_0;    // 0
-    uint32_t reserved_1;    // 0
-    uint32_t reserved_2;    // 0
-    uint32_t proj_id;       // group/project id (set to gid or 0)
-    uint32_t uid16_gid16;   // 0
-    uint64_t xattr_ptr;     // 0
-    uint64_t inode_crc;     // 8 bytes, low 4 bytes carry CRC
-} inode_t;
-#pragma pack(pop)
-
-_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size must be 128 bytes");
-
-// inode CRC finalize (as provided)
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
-}
+// Splits `blocks` blocks into the inode bitmap and table for `inodes` inodes, a data
+// bitmap, and the data region it covers. Returns -1 if no data block would be left.
+static int layout_region(uint64_t blocks, uint64_t inodes, region_layout_t *l) {
+    const uint64_t bits_per_block = BS * 8u;
+    const uint64_t inodes_per_block = BS / INODE_SIZE;
 
-// ====================== Dirent (64 bytes) ======================
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;      // 0 if free
-    uint8_t  type;          // 1=file, 2=dir
-    char     name[58];      // NUL-terminated if shorter
-    uint8_t  checksum;      // XOR of first 63 bytes
-} dirent64_t;
-#pragma pack(pop)
-
-_Static_assert(sizeof(dirent64_t) == 64, "dirent64_t must be 64 bytes");
-
-// dirent checksum finalize (as provided)
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
-}
+    l->inode_bitmap_blocks = div_round_up_u64(inodes, bits_per_block);
+    if (l->inode_bitmap_blocks == 0) l->inode_bitmap_blocks = 1; // allocate at least one block
+
+    l->inode_table_blocks = div_round_up_u64(inodes, inodes_per_block);
 
-// ====================== Helpers ======================
-static inline uint64_t div_round_up_u64(uint64_t a, uint64_t b) {
-    return (a + b - 1) / b;
+    // data bitmap depends on data region size; iterate to convergence
+    l->data_bitmap_blocks = 1; // start with 1 block
+    for (int iter = 0; iter < 8; ++iter) {
+        uint64_t used_except_data = l->inode_bitmap_blocks + l->inode_table_blocks;
+        uint64_t data_region_blocks = (blocks > (used_except_data + l->data_bitmap_blocks))
+                                        ? (blocks - used_except_data - l->data_bitmap_blocks)
+                                        : 0;
+        uint64_t need_dbm = div_round_up_u64(data_region_blocks, bits_per_block);
+        if (need_dbm == 0) need_dbm = 1;
+        if (need_dbm == l->data_bitmap_blocks) break;
+        l->data_bitmap_blocks = need_dbm;
+    }
+
+    // Now finalize region sizes
+    uint64_t used_except_data = l->inode_bitmap_blocks + l->inode_table_blocks + l->data_bitmap_blocks;
+    if (blocks <= used_except_data) return -1;
+    l->data_region_blocks = blocks - used_except_data;
+    return 0;
 }
 
-static inline void set_bit(uint8_t *bitmap, uint64_t bit_index) {
-    bitmap[bit_index >> 3u] |= (uint8_t)(1u << (bit_index & 7u));
+typedef struct {
+    uint64_t count;
+    uint64_t desc_blocks;
+    uint64_t inodes_per_group;
+    uint64_t last_blocks;       // blocks in the last group (per_group for the others)
+    region_layout_t full;       // every group but the last
+    region_layout_t last;
+} group_layout_t;
+
+// Lays out block groups of `per_group` blocks after the superblock and the descriptor
+// table, sharing `num_inodes` (rounded up to whole inode-table blocks) evenly between them.
+// A tail too short for its own metadata and one data block is left unused.
+static int layout_groups(uint64_t total_blocks, uint64_t per_group, uint64_t num_inodes, group_layout_t *gl) {
+    // The table's size depends on the group count and the other way round
+    gl->desc_blocks = 1;
+    for (int iter = 0; iter < 8; ++iter) {
+        uint64_t avail = total_blocks > 1 + gl->desc_blocks ? total_blocks - 1 - gl->desc_blocks : 0;
+        uint64_t need = div_round_up_u64(div_round_up_u64(avail, per_group), GROUP_DESCS_PER_BLOCK);
+        if (need == 0) need = 1;
+        if (need == gl->desc_blocks) break;
+        gl->desc_blocks = need;
+    }
+    if (total_blocks <= 1 + gl->desc_blocks) return -1;
+    uint64_t avail = total_blocks - 1 - gl->desc_blocks;
+
+    for (gl->count = div_round_up_u64(avail, per_group); gl->count > 0; gl->count--) {
+        gl->inodes_per_group = div_round_up_u64(div_round_up_u64(num_inodes, gl->count), BS / INODE_SIZE) * (BS / INODE_SIZE);
+        if (layout_region(avail < per_group ? avail : per_group, gl->inodes_per_group, &gl->full) < 0) return -1;
+        gl->last_blocks = avail - (gl->count - 1) * per_group;
+        if (gl->last_blocks > per_group) gl->last_blocks = per_group;
+        if (layout_region(gl->last_blocks, gl->inodes_per_group, &gl->last) == 0) return 0;
+    }
+    return -1;
 }
 
 // ====================== Main ======================
@@ -129,11 +283,21 @@ int main(int argc, char *argv[]) {
     char *output_file = NULL;
     uint64_t size_kib = 0;
     uint64_t num_inodes = 0;
+    int threads = 1;
+    int io_backend = MVFS_IO_AUTO;
+    int lazy_itable = 0;
+    uint64_t blocks_per_group = 0;   // 0: one flat layout
+    int stats = 0;
 
     static struct option long_options[] = {
         {"image", required_argument, 0, 'i'},
         {"size-kib", required_argument, 0, 's'},
         {"inodes", required_argument, 0, 'n'},
+        {"threads", required_argument, 0, 't'},
+        {"io", required_argument, 0, 'o'},
+        {"lazy-itable", no_argument, 0, 'l'},
+        {"block-groups", optional_argument, 0, 'g'},
+        {"stats", required_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
 
@@ -144,17 +308,30 @@ int main(int argc, char *argv[]) {
             case 'i': output_file = optarg; break;
             case 's': size_kib = strtoull(optarg, NULL, 10); break;
             case 'n': num_inodes = strtoull(optarg, NULL, 10); break;
+            case 't': threads = atoi(optarg); break;
+            case 'o':
+                if (strcmp(optarg, "sync") == 0) io_backend = MVFS_IO_SYNC;
+                else if (strcmp(optarg, "uring") == 0) io_backend = MVFS_IO_URING;
+                else io_backend = -1;
+                break;
+            case 'l': lazy_itable = 1; break;
+            case 'g': blocks_per_group = optarg ? strtoull(optarg, NULL, 10) : DEFAULT_BLOCKS_PER_GROUP; break;
+            case 'S': stats = strcmp(optarg, "json") == 0 ? 1 : -1; break;
             default:
-                fprintf(stderr, "Usage: %s --image <output_file> --size-kib <size> --inodes <count>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --image <output_file> --size-kib <size> --inodes <count> [--threads <n>] [--lazy-itable] [--block-groups[=<blocks_per_group>]] [--io <sync|uring>] [--stats=json]\n", argv[0]);
                 return 1;
         }
     }
 
-    if (!output_file || size_kib == 0 || num_inodes == 0) {
-        fprintf(stderr, "Usage: %s --image <output_file> --size-kib <size> --inodes <count>\n", argv[0]);
+    if (!output_file || size_kib == 0 || num_inodes == 0 || threads < 1 || threads > MAX_THREADS || io_backend < 0 || stats < 0 ||
+        (blocks_per_group != 0 && (blocks_per_group < 8 || blocks_per_group > UINT32_MAX))) {
+        fprintf(stderr, "Usage: %s --image <output_file> --size-kib <size> --inodes <count> [--threads <n>] [--lazy-itable] [--block-groups[=<blocks_per_group>]] [--io <sync|uring>] [--stats=json]\n", argv[0]);
         return 1;
     }
 
+    // Phases for --stats: there are no bitmaps to load, the inode table is the bulk write
+    uint64_t run_started = mvfs_now_ns();
+
     // Derived values
     uint64_t total_blocks = (size_kib * 1024u) / BS;
     if (total_blocks < 8) {
@@ -162,38 +339,31 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Layout calculation
-    const uint64_t bits_per_block = BS * 8u;
+    // Layout calculation: one region after the superblock, or one per block group
     const uint64_t inodes_per_block = BS / INODE_SIZE;
-
-    uint64_t inode_bitmap_blocks = div_round_up_u64(num_inodes, bits_per_block);
-    if (inode_bitmap_blocks == 0) inode_bitmap_blocks = 1; // allocate at least one block
-
-    uint64_t inode_table_blocks = div_round_up_u64(num_inodes, inodes_per_block);
-
-    // data bitmap depends on data region size; iterate to convergence
-    uint64_t data_bitmap_blocks = 1; // start with 1 block
-    for (int iter = 0; iter < 8; ++iter) {
-        uint64_t used_except_data = 1 /*superblock*/ + inode_bitmap_blocks + inode_table_blocks;
-        uint64_t data_region_blocks = (total_blocks > (used_except_data + data_bitmap_blocks))
-                                        ? (total_blocks - used_except_data - data_bitmap_blocks)
-                                        : 0;
-        uint64_t need_dbm = div_round_up_u64(data_region_blocks, bits_per_block);
-        if (need_dbm == 0) need_dbm = 1;
-        if (need_dbm == data_bitmap_blocks) break;
-        data_bitmap_blocks = need_dbm;
-    }
-
-    // Now finalize region sizes
-    uint64_t used_except_data = 1 + inode_bitmap_blocks + inode_table_blocks + data_bitmap_blocks;
-    if (total_blocks <= used_except_data) {
+    group_layout_t gl;
+    memset(&gl, 0, sizeof(gl));
+    region_layout_t first;      // the only region, or group 0
+    uint64_t first_start = 1;
+    if (blocks_per_group) {
+        if (layout_groups(total_blocks, blocks_per_group, num_inodes, &gl) < 0) {
+            fprintf(stderr, "Image too small for block groups of %" PRIu64 " blocks with given inode count.\n", blocks_per_group);
+            return 1;
+        }
+        first = gl.count > 1 ? gl.full : gl.last;
+        first_start = 1 + gl.desc_blocks;
+        num_inodes = gl.count * gl.inodes_per_group;
+    } else if (layout_region(total_blocks - 1, num_inodes, &first) < 0) {
         fprintf(stderr, "Image too small for metadata with given inode count.\n");
         return 1;
     }
-    uint64_t data_region_blocks = total_blocks - used_except_data;
+    uint64_t inode_bitmap_blocks = first.inode_bitmap_blocks;
+    uint64_t data_bitmap_blocks = first.data_bitmap_blocks;
+    uint64_t inode_table_blocks = first.inode_table_blocks;
+    uint64_t data_region_blocks = first.data_region_blocks;
 
     // Region starts
-    uint64_t inode_bitmap_start = 1;
+    uint64_t inode_bitmap_start = first_start;
     uint64_t data_bitmap_start  = inode_bitmap_start + inode_bitmap_blocks;
     uint64_t inode_table_start  = data_bitmap_start + data_bitmap_blocks;
     uint64_t data_region_start  = inode_table_start + inode_table_blocks;
@@ -202,8 +372,8 @@ int main(int argc, char *argv[]) {
     uint8_t sb_block[BS];
     memset(sb_block, 0, sizeof(sb_block));
     superblock_t *sb = (superblock_t*)sb_block;
-    sb->magic = 0x4D565346u;
-    sb->version = 1;
+    sb->magic = MVSF_MAGIC;
+    sb->version = blocks_per_group ? MVSF_VERSION_BLOCK_GROUPS : MVSF_VERSION_DIRECT;
     sb->block_size = BS;
     sb->total_blocks = total_blocks;
     sb->inode_count = num_inodes;
@@ -217,36 +387,65 @@ int main(int argc, char *argv[]) {
     sb->data_region_blocks = data_region_blocks;
     sb->root_inode = ROOT_INO;
     sb->mtime_epoch = (uint64_t)time(NULL);
-    sb->flags = 0;
-    crc32_init();
-    superblock_crc_finalize(sb);
+    sb->flags = (lazy_itable ? SB_FLAG_LAZY_ITABLE : 0) | (blocks_per_group ? SB_FLAG_BLOCK_GROUPS : 0);
+    // Lazy: only the block holding the root inode is written; the rest stay holes
+    sb->itable_init_blocks = lazy_itable ? 1 : inode_table_blocks;
+    sb->inode_cursor = 1;      // bit 0 is the root inode
+    sb->data_cursor = 1;       // bit 0 is the root directory block
+    if (blocks_per_group) {
+        sb->group_count = gl.count;
+        sb->blocks_per_group = blocks_per_group;
+        sb->inodes_per_group = gl.inodes_per_group;
+        sb->group_desc_start = 1;
+        sb->group_desc_blocks = gl.desc_blocks;
+    }
+    mvfs_init();
 
-    // Open output
+    // Open output at its full size: everything not written below stays a hole (zeros)
     int fd = open(output_file, O_CREAT | O_RDWR | O_TRUNC, 0666);
     if (fd < 0) { perror("open"); return 1; }
+    off_t target_size = (off_t)total_blocks * BS;
+    if (ftruncate(fd, target_size) != 0) { perror("ftruncate"); close(fd); return 1; }
+
+    mvfs_t fs;
+    if (mvfs_map(&fs, fd, 1) < 0) { close(fd); return 1; }
+    mvfs_io_t io;
+    if (mvfs_io_init(&io, fd, io_backend, MVFS_IO_DEPTH) < 0) { mvfs_close(&fs); return 1; }
+    fs.io = &io;
+    memcpy(mvfs_block(&fs, 0), sb_block, BS);
+
+    // Group descriptors: each group's regions in the same order as the flat layout
+    group_desc_t *descs = (group_desc_t*)mvfs_block(&fs, 1);
+    for (uint64_t g = 0; g < gl.count; ++g) {
+        const region_layout_t *l = g + 1 < gl.count ? &gl.full : &gl.last;
+        group_desc_t *gd = &descs[g];
+        gd->inode_bitmap_start = first_start + g * blocks_per_group;
+        gd->data_bitmap_start = gd->inode_bitmap_start + l->inode_bitmap_blocks;
+        gd->inode_table_start = gd->data_bitmap_start + l->data_bitmap_blocks;
+        gd->data_region_start = gd->inode_table_start + l->inode_table_blocks;
+        gd->data_region_blocks = (uint32_t)l->data_region_blocks;
+        gd->free_blocks = gd->data_region_blocks;
+        gd->free_inodes = (uint32_t)gl.inodes_per_group;
+        gd->itable_init_blocks = (uint32_t)(lazy_itable ? (g == 0) : l->inode_table_blocks);
+        group_desc_crc_finalize(gd);
+    }
 
-    // Write superblock block
-    if (write(fd, sb_block, BS) != (ssize_t)BS) { perror("write superblock"); close(fd); return 1; }
+    if (mvfs_load(&fs) < 0) { mvfs_io_close(&io); mvfs_close(&fs); return 1; }
+    mvfs_mark_dirty(&fs, 0, 1);
+    uint64_t phase_started = mvfs_now_ns();
+    mvfs_stats_add(MVFS_PHASE_LAYOUT, phase_started - run_started);
+    mvfs_group_t *g0 = &fs.groups[0];
 
-    // Write inode bitmap blocks
-    uint8_t *inode_bm = (uint8_t*)calloc(inode_bitmap_blocks, BS);
-    if (!inode_bm) { perror("calloc inode_bm"); close(fd); return 1; }
     // Mark inode #1 allocated (bit 0)
-    set_bit(inode_bm, 0);
-    if (write(fd, inode_bm, inode_bitmap_blocks * BS) != (ssize_t)(inode_bitmap_blocks * BS)) {
-        perror("write inode bitmap"); free(inode_bm); close(fd); return 1;
-    }
-    free(inode_bm);
+    set_bit(g0->inode_bitmap, 0);
+    mvfs_group_count(g0, -1, 0);
+    mvfs_mark_dirty(&fs, inode_bitmap_start, 1);
 
-    // Write data bitmap blocks
-    uint8_t *data_bm = (uint8_t*)calloc(data_bitmap_blocks, BS);
-    if (!data_bm) { perror("calloc data_bm"); close(fd); return 1; }
     // We will allocate one data block for root directory: this is the first data block
-    set_bit(data_bm, 0); // bit 0 of data region
-    if (write(fd, data_bm, data_bitmap_blocks * BS) != (ssize_t)(data_bitmap_blocks * BS)) {
-        perror("write data bitmap"); free(data_bm); close(fd); return 1;
-    }
-    free(data_bm);
+    set_bit(g0->data_bitmap, 0); // bit 0 of data region
+    *g0->data_cursor = 1;
+    mvfs_group_count(g0, 0, -1);
+    mvfs_mark_dirty(&fs, data_bitmap_start, 1);
 
     // Write inode table
     uint64_t now = (uint64_t)time(NULL);
@@ -270,26 +469,42 @@ int main(int argc, char *argv[]) {
     root.proj_id = 0;
     root.uid16_gid16 = 0;
     root.xattr_ptr = 0;
-    inode_crc_finalize(&root);
-
-    // Write entire inode table
-    for (uint64_t i = 0; i < num_inodes; ++i) {
-        if (i == 0) {
-            if (write(fd, &root, sizeof(root)) != (ssize_t)sizeof(root)) { perror("write root inode"); close(fd); return 1; }
-        } else {
-            inode_t e = zino;
-            inode_crc_finalize(&e);
-            if (write(fd, &e, sizeof(e)) != (ssize_t)sizeof(e)) { perror("write empty inode"); close(fd); return 1; }
+    mvfs_put_inode(&fs, ROOT_INO, &root);
+    uint64_t phase_ended = mvfs_now_ns();
+    mvfs_stats_add(MVFS_PHASE_ALLOCATION, phase_ended - phase_started);
+    phase_started = phase_ended;
+
+    // Write the inode table: the root, then every empty slot in large batched writes
+    // (only up to the high-water mark when lazy; the adder fills in the rest on demand).
+    // The empty slots go through the fd, not the mapping, so no page is faulted in for them;
+    // mvfs_commit() syncs them before the superblock. With block groups every group's table
+    // is written the same way; through io_uring, all of them in one pass over --threads queues.
+    int queued = mvfs_io_async(&io);
+    itable_range_t *ranges = queued ? (itable_range_t*)calloc(fs.group_count, sizeof(*ranges)) : NULL;
+    if (queued && !ranges) { perror("calloc inode table ranges"); mvfs_io_close(&io); mvfs_close(&fs); return 1; }
+    for (uint64_t g = 0; g < fs.group_count; ++g) {
+        mvfs_group_t *grp = &fs.groups[g];
+        uint64_t init_blocks = grp->desc ? grp->desc->itable_init_blocks : sb->itable_init_blocks;
+        uint64_t itable_slots = init_blocks * inodes_per_block;
+        if (itable_slots > grp->inode_count) itable_slots = grp->inode_count;
+        uint64_t first_slot = g == 0 ? 1 : 0;
+        if (queued) {
+            ranges[g].offset = grp->inode_table_start * BS + first_slot * INODE_SIZE;
+            ranges[g].length = itable_slots > first_slot ? (itable_slots - first_slot) * INODE_SIZE : 0;
+        } else if (write_empty_inodes(fd, grp->inode_table_start, first_slot, itable_slots, threads) != 0) {
+            mvfs_io_close(&io); mvfs_close(&fs); return 1;
         }
+        mvfs_mark_data_dirty(&fs, grp->inode_table_start, div_round_up_u64(itable_slots * INODE_SIZE, BS));
+    }
+    if (queued) {
+        int wrc = write_empty_inodes_queued(&io, ranges, fs.group_count, threads);
+        free(ranges);
+        if (wrc != 0) { mvfs_io_close(&io); mvfs_close(&fs); return 1; }
     }
 
     // Write data region: first block = root directory with "." and ".."
-    // Position the file to start of data region
-    off_t data_start_off = (off_t)data_region_start * BS;
-    if (lseek(fd, data_start_off, SEEK_SET) == (off_t)-1) { perror("lseek data start"); close(fd); return 1; }
-
-    uint8_t data_block[BS]; memset(data_block, 0, sizeof(data_block));
-    dirent64_t *de = (dirent64_t*)data_block;
+    dirent64_t *de = (dirent64_t*)mvfs_block(&fs, data_region_start);
+    mvfs_mark_dirty(&fs, data_region_start, 1);
 
     // "." entry
     de[0].inode_no = ROOT_INO;
@@ -305,34 +520,53 @@ int main(int argc, char *argv[]) {
     strncpy(de[1].name, "..", sizeof(de[1].name)-1);
     dirent_checksum_finalize(&de[1]);
 
-    if (write(fd, data_block, BS) != (ssize_t)BS) { perror("write root dir data"); close(fd); return 1; }
-
-    // Pad file to requested size
-    off_t target_size = (off_t)total_blocks * BS;
-    if (ftruncate(fd, target_size) != 0) { perror("ftruncate"); close(fd); return 1; }
+    phase_ended = mvfs_now_ns();
+    mvfs_stats_add(MVFS_PHASE_DATA_COPY, phase_ended - phase_started);
+    phase_started = phase_ended;
 
-    close(fd);
+    // Superblock CRC, then every block touched through the mapping goes out
+    int rc = mvfs_commit(&fs);
+    memcpy(sb_block, mvfs_block(&fs, 0), BS);
+    mvfs_io_close(&io);
+    mvfs_close(&fs);
+    mvfs_stats_add(MVFS_PHASE_WRITEBACK, mvfs_now_ns() - phase_started);
+    if (rc != 0) return 1;
 
     printf("MiniVSFS image '%s' created.\n", output_file);
     printf("  Blocks:          %" PRIu64 " (size: %" PRIu64 " KiB)\n", total_blocks, size_kib);
     printf("  Inodes:          %" PRIu64 "\n", num_inodes);
     printf("  Layout (blocks):\n");
     printf("    [0] superblock\n");
-    printf("    [%" PRIu64 " .. %" PRIu64 "] inode bitmap (%" PRIu64 " blocks)\n",
-       sb->inode_bitmap_start, sb->inode_bitmap_start + sb->inode_bitmap_blocks - 1,
-       sb->inode_bitmap_blocks);
-
-printf("    [%" PRIu64 " .. %" PRIu64 "] data bitmap (%" PRIu64 " blocks)\n",
-       sb->data_bitmap_start, sb->data_bitmap_start + sb->data_bitmap_blocks - 1,
-       sb->data_bitmap_blocks);
-
-printf("    [%" PRIu64 " .. %" PRIu64 "] inode table (%" PRIu64 " blocks)\n",
-       sb->inode_table_start, sb->inode_table_start + sb->inode_table_blocks - 1,
-       sb->inode_table_blocks);
-
-printf("    [%" PRIu64 " .. %" PRIu64 "] data region (%" PRIu64 " blocks)\n",
-       sb->data_region_start, sb->data_region_start + sb->data_region_blocks - 1,
-       sb->data_region_blocks);
+    if (blocks_per_group) {
+        printf("    [%" PRIu64 " .. %" PRIu64 "] group descriptors (%" PRIu64 " groups of %" PRIu64 " blocks, %" PRIu64 " inodes each)\n",
+               sb->group_desc_start, sb->group_desc_start + sb->group_desc_blocks - 1,
+               sb->group_count, sb->blocks_per_group, sb->inodes_per_group);
+        for (uint64_t g = 0; g < gl.count; ++g) {
+            // Long tables: the first groups and the last one
+            if (gl.count > 8 && g == 4) printf("    ...\n");
+            if (gl.count > 8 && g >= 4 && g + 1 < gl.count) continue;
+            const region_layout_t *l = g + 1 < gl.count ? &gl.full : &gl.last;
+            uint64_t start = first_start + g * blocks_per_group;
+            printf("    [%" PRIu64 " .. %" PRIu64 "] group %" PRIu64 ": data region from %" PRIu64 " (%" PRIu64 " blocks)%s\n",
+                   start, start + (g + 1 < gl.count ? blocks_per_group : gl.last_blocks) - 1, g,
+                   start + l->inode_bitmap_blocks + l->data_bitmap_blocks + l->inode_table_blocks,
+                   l->data_region_blocks, lazy_itable ? ", inode table lazily initialized" : "");
+        }
+    } else {
+        printf("    [%" PRIu64 " .. %" PRIu64 "] inode bitmap (%" PRIu64 " blocks)\n",
+               sb->inode_bitmap_start, sb->inode_bitmap_start + sb->inode_bitmap_blocks - 1,
+               sb->inode_bitmap_blocks);
+        printf("    [%" PRIu64 " .. %" PRIu64 "] data bitmap (%" PRIu64 " blocks)\n",
+               sb->data_bitmap_start, sb->data_bitmap_start + sb->data_bitmap_blocks - 1,
+               sb->data_bitmap_blocks);
+        printf("    [%" PRIu64 " .. %" PRIu64 "] inode table (%" PRIu64 " blocks%s)\n",
+               sb->inode_table_start, sb->inode_table_start + sb->inode_table_blocks - 1,
+               sb->inode_table_blocks, lazy_itable ? ", lazily initialized" : "");
+        printf("    [%" PRIu64 " .. %" PRIu64 "] data region (%" PRIu64 " blocks)\n",
+               sb->data_region_start, sb->data_region_start + sb->data_region_blocks - 1,
+               sb->data_region_blocks);
+    }
 
+    if (stats) mvfs_stats_print_json(stdout, "mkfs_builder", 0, 0, mvfs_now_ns() - run_started);
     return 0;
 }
@@ -0,0 +1,30 @@
+// Input for check_scanner.sh: the flex and SIMD scanners must give identical tokens for all of it.
+/* The language has no comments, so both scanners split this block into
+   MULOP and ID tokens; unmatched bytes such as ' # " @ $ ` & | \ . are echoed */
+
+int i, in, iffy, int_max, form, fo, doer, d, elsewhere, el, whiled, breaker;
+float floaty, fl, chars, voidx, doubled, returned, switcher, casework, defaults;
+void printfx(int continues, int _if, int if_, int IF, int Int);
+
+int main()
+{
+	int a[10], k, e, E, e3, E3, _e1;
+	float x, y;
+
+	if (a[0] == 1) k = 2; else k = 3;
+	for (k = 0; k < 10; k++) a[k] = k * 2 % 7;
+	while (k >= 0) k--;
+	do k++; while (k <= 5);
+	switch (k) { case 1: break; case -2: k = 0; default: continue; }
+	return k;
+
+	x = 0; x = 7; x = 42; x = 0123; x = 9999999999;
+	x = 3.14; x = .5; x = 0.0; x = 1.; x = 1.5.6; x = 12..3;
+	x = 1e-3; x = 1E5; x = 2.5e-10; x = .5e3; x = 1e+3; x = 1.e5;
+	x = e-3; x = e3; x = E-12; x = 3e; x = 1e-; x = 9e--3; x = 0e0;
+	y = x+y-x*y/x%k; k++; k--; k+++k; k---k; k+-k;
+	k = k<y; k = k>y; k = k<=y; k = k>=y; k = k==y; k = k!=y; k = k<<=y; k = k===y; k = !k!=!y;
+	k = k&&y; k = k||y; k = k&y; k = k|y; k = k&&&y; k = k|||y;
+	printf(k);
+	printfx(k,k,k,k,k);
+}
@@ -8,8 +8,9 @@ flex 22301258.l
 echo 'Generated the scanner C file'
 g++ -fpermissive -w -c -o l.o lex.yy.c
 # if the above command doesn't work try g++ -fpermissive -w -c -o l.o lex.yy.c
+# add -DSIMD_SCANNER (and -mavx2) to use the hand-written SIMD scanner instead of flex
 echo 'Generated the scanner object file'
-g++ y.o l.o
+g++ -pthread y.o l.o
 echo 'All ready, running'
 ./a.exe input.c
 echo 'logfile'
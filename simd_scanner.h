@@ -0,0 +1,316 @@
+#include<bits/stdc++.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+using namespace std;
+
+// Hand-written scanner for the token set of 22301258.l. Whitespace and
+// identifier runs are classified 32 bytes at a time (one AVX2 compare, or
+// two SSE2 ones) and skipped with ctz over the resulting bitmask; keywords
+// are recognised with a perfect hash on the first two characters and the
+// length. It follows flex's longest-match and first-rule-wins resolution,
+// including the quirks of the floats pattern (".5", "1e-3", "e-3"), so it
+// produces the same tokens and line counts as the flex scanner. Build with
+// -DSIMD_SCANNER to use it in place of flex. check_scanner.sh compares the
+// two on scanner_check.c through --check-scanner.
+
+#define SIMD_KEYWORD_SLOTS 32
+
+class keyword_entry
+{
+public:
+    const char *word;
+    int length;
+    int token;
+};
+
+static inline unsigned keyword_hash(const char *p, int length)
+{
+    return ((unsigned char)p[0] * 2u + (unsigned char)p[1] * 21u + (unsigned)length * 3u) & (SIMD_KEYWORD_SLOTS - 1);
+}
+
+static const keyword_entry *keyword_table()
+{
+    // Collision free for the 17 keywords, checked when the table is built
+    static keyword_entry table[SIMD_KEYWORD_SLOTS];
+    static bool built = [] {
+        const char *words[] = {"if", "else", "for", "while", "do", "break", "continue", "return", "int",
+                               "float", "char", "void", "double", "switch", "case", "default", "printf"};
+        int tokens[] = {IF, ELSE, FOR, WHILE, DO, BREAK, CONTINUE, RETURN, INT,
+                        FLOAT, CHAR, VOID, DOUBLE, SWITCH, CASE, DEFAULT, PRINTLN};
+        for (int i = 0; i < 17; i++)
+        {
+            int length = strlen(words[i]);
+            unsigned slot = keyword_hash(words[i], length);
+            assert(table[slot].word == NULL);
+            table[slot].word = words[i];
+            table[slot].length = length;
+            table[slot].token = tokens[i];
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+static inline int keyword_lookup(const char *p, int length)
+{
+    if (length < 2 || length > 8)
+        return 0;
+
+    const keyword_entry &entry = keyword_table()[keyword_hash(p, length)];
+    if (entry.length == length && memcmp(entry.word, p, length) == 0)
+        return entry.token;
+    return 0;
+}
+
+static inline bool is_space_byte(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r'); // includes '\n', counted separately
+}
+
+static inline bool is_ident_byte(unsigned char c)
+{
+    return isalnum(c) || c == '_';
+}
+
+#if defined(__SSE2__)
+// Bit i of each mask is set when byte i of the 32-byte block is in the class
+static inline __m128i byte_in_range(__m128i v, char low, char high)
+{
+    // Signed compares are fine: the ranges are ASCII, bytes >= 0x80 compare as negative
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(high + 1)));
+}
+
+static inline void classify16(const char *p, unsigned &space, unsigned &newline, unsigned &ident)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), byte_in_range(v, '\t', '\r'));
+    __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i id = _mm_or_si128(_mm_or_si128(byte_in_range(lower, 'a', 'z'), byte_in_range(v, '0', '9')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    space = (unsigned)_mm_movemask_epi8(sp);
+    newline = (unsigned)_mm_movemask_epi8(nl);
+    ident = (unsigned)_mm_movemask_epi8(id);
+}
+
+static inline void classify32(const char *p, uint32_t &space, uint32_t &newline, uint32_t &ident)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    auto in_range = [](__m256i x, char low, char high) {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(low - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), x));
+    };
+    __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range(v, '\t', '\r'));
+    __m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i id = _mm256_or_si256(_mm256_or_si256(in_range(lower, 'a', 'z'), in_range(v, '0', '9')),
+                                 _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    space = (uint32_t)_mm256_movemask_epi8(sp);
+    newline = (uint32_t)_mm256_movemask_epi8(nl);
+    ident = (uint32_t)_mm256_movemask_epi8(id);
+#else
+    unsigned s0, n0, i0, s1, n1, i1;
+    classify16(p, s0, n0, i0);
+    classify16(p + 16, s1, n1, i1);
+    space = s0 | (s1 << 16);
+    newline = n0 | (n1 << 16);
+    ident = i0 | (i1 << 16);
+#endif
+}
+#endif
+
+// Length of the whitespace/newline run at p; adds the newlines in it to `newlines`
+static inline size_t skip_space_run(const char *p, const char *end, int &newlines)
+{
+    const char *start = p;
+#if defined(__SSE2__)
+    while (end - p >= 32)
+    {
+        uint32_t space, newline, ident;
+        classify32(p, space, newline, ident);
+        if (space != 0xFFFFFFFFu)
+        {
+            int run = __builtin_ctz(~space);
+            newlines += __builtin_popcount(newline & ((1u << run) - 1));
+            return p + run - start;
+        }
+        newlines += __builtin_popcount(newline);
+        p += 32;
+    }
+#endif
+    while (p < end && is_space_byte(*p))
+    {
+        if (*p == '\n') newlines++;
+        p++;
+    }
+    return p - start;
+}
+
+static inline size_t ident_run(const char *p, const char *end)
+{
+    const char *start = p;
+#if defined(__SSE2__)
+    while (end - p >= 32)
+    {
+        uint32_t space, newline, ident;
+        classify32(p, space, newline, ident);
+        if (ident != 0xFFFFFFFFu)
+        {
+            return p + __builtin_ctz(~ident) - start;
+        }
+        p += 32;
+    }
+#endif
+    while (p < end && is_ident_byte(*p))
+    {
+        p++;
+    }
+    return p - start;
+}
+
+static inline size_t digit_run(const char *p, const char *end)
+{
+    const char *start = p;
+    while (p < end && isdigit((unsigned char)*p))
+    {
+        p++;
+    }
+    return p - start;
+}
+
+// Longest match of {integers} or {floats} at p; is_float tells which rule won
+static size_t number_length(const char *p, const char *end, bool &is_float)
+{
+    size_t digits = digit_run(p, end);
+    size_t best = digits;
+    is_float = false;
+
+    // {digit}*(\.{digit}+)
+    size_t with_fraction = 0;
+    if (p + digits + 1 < end && p[digits] == '.' && isdigit((unsigned char)p[digits + 1]))
+    {
+        with_fraction = digits + 1 + digit_run(p + digits + 1, end);
+        if (with_fraction > best)
+        {
+            best = with_fraction;
+            is_float = true;
+        }
+    }
+
+    // {digit}*(\.{digit}+)?((E|e)[-]?{digit}+), with and without the fraction
+    size_t bases[2] = {with_fraction, digits};
+    for (size_t base : bases)
+    {
+        if (base == 0 && digits != 0)
+            continue;
+        const char *q = p + base;
+        if (q < end && (*q == 'e' || *q == 'E'))
+        {
+            q++;
+            if (q < end && *q == '-') q++;
+            size_t exponent = digit_run(q, end);
+            if (exponent > 0 && (size_t)(q + exponent - p) > best)
+            {
+                best = q + exponent - p;
+                is_float = true;
+            }
+        }
+    }
+
+    return best;
+}
+
+int simd_lex_chunk(const char *text, size_t length, vector<lexed_token> &out, string &echo)
+{
+    const char *p = text;
+    const char *end = text + length;
+    int newlines = 0;
+
+    while (p < end)
+    {
+        unsigned char c = *p;
+
+        if (is_space_byte(c))
+        {
+            p += skip_space_run(p, end, newlines);
+            continue;
+        }
+
+        if (isalpha(c) || c == '_')
+        {
+            size_t run = ident_run(p, end);
+
+            // "e-3" is a float by {floats}; it is longer than the identifier "e"
+            if ((c == 'e' || c == 'E') && run == 1 && p + 2 < end && p[1] == '-' && isdigit((unsigned char)p[2]))
+            {
+                bool is_float;
+                size_t n = number_length(p, end, is_float);
+                out.push_back(lexed_token(CONST_FLOAT, new symbol_info(string(p, n), "FLOAT"), newlines));
+                p += n;
+                continue;
+            }
+
+            int keyword = keyword_lookup(p, run);
+            if (keyword != 0)
+                out.push_back(lexed_token(keyword, NULL, newlines));
+            else
+                out.push_back(lexed_token(ID, new symbol_info(string(p, run), "ID"), newlines));
+            p += run;
+            continue;
+        }
+
+        if (isdigit(c) || c == '.')
+        {
+            bool is_float;
+            size_t n = number_length(p, end, is_float);
+            if (n > 0)
+            {
+                out.push_back(is_float ? lexed_token(CONST_FLOAT, new symbol_info(string(p, n), "FLOAT"), newlines)
+                                       : lexed_token(CONST_INT, new symbol_info(string(p, n), "INT"), newlines));
+                p += n;
+                continue;
+            }
+        }
+
+        char next = p + 1 < end ? p[1] : '\0';
+        int kind = 0;
+        const char *type = NULL;
+        int n = 1;
+
+        switch (c)
+        {
+            case '+': if (next == '+') { kind = INCOP; n = 2; } else { kind = ADDOP; type = "ADDOP"; } break;
+            case '-': if (next == '-') { kind = DECOP; n = 2; } else { kind = ADDOP; type = "ADDOP"; } break;
+            case '*': case '/': case '%': kind = MULOP; type = "MULOP"; break;
+            case '<': case '>': kind = RELOP; type = "RELOP"; if (next == '=') n = 2; break;
+            case '=': if (next == '=') { kind = RELOP; type = "RELOP"; n = 2; } else { kind = ASSIGNOP; } break;
+            case '!': if (next == '=') { kind = RELOP; type = "RELOP"; n = 2; } else { kind = NOT; } break;
+            case '&': if (next == '&') { kind = LOGICOP; type = "LOGICOP"; n = 2; } break;
+            case '|': if (next == '|') { kind = LOGICOP; type = "LOGICOP"; n = 2; } break;
+            case '(': kind = LPAREN; break;
+            case ')': kind = RPAREN; break;
+            case '{': kind = LCURL; break;
+            case '}': kind = RCURL; break;
+            case '[': kind = LTHIRD; break;
+            case ']': kind = RTHIRD; break;
+            case ';': kind = SEMICOLON; break;
+            case ',': kind = COMMA; break;
+            case ':': kind = COLON; break;
+        }
+
+        if (kind == 0)
+        {
+            echo += (char)c; // flex's default rule echoes what no rule matches
+            p++;
+            continue;
+        }
+
+        out.push_back(lexed_token(kind, type != NULL ? new symbol_info(string(p, n), type) : NULL, newlines));
+        p += n;
+    }
+
+    return newlines;
+}
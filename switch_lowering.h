@@ -0,0 +1,123 @@
+#include<bits/stdc++.h>
+using namespace std;
+
+// Chooses how a switch statement is dispatched from the density of its case labels.
+// Tiny switches become a compare chain, dense ones a bounds-checked jump table and
+// sparse ones a balanced binary decision tree over the sorted labels.
+
+#define SWITCH_CHAIN_MAX_CASES 3
+#define SWITCH_TABLE_MIN_DENSITY 0.4
+#define SWITCH_TABLE_MAX_RANGE 4096
+
+class switch_lowering
+{
+private:
+    int start_line;
+    int scope_id;               // scope table of the switch body
+    vector<long long> labels;
+    bool has_default;
+
+public:
+    switch_lowering(int start_line, int scope_id);
+    int get_start_line();
+    int get_scope_id();
+    bool add_case(long long value);
+    bool set_default();
+    int get_case_count();
+    string choose_lowering();
+    ~switch_lowering();
+};
+
+//methods of switch_lowering class
+
+switch_lowering::switch_lowering(int start_line, int scope_id)
+{
+    this->start_line = start_line;
+    this->scope_id = scope_id;
+    this->has_default = false;
+}
+
+int switch_lowering::get_start_line()
+{
+    return start_line;
+}
+
+int switch_lowering::get_scope_id()
+{
+    return scope_id;
+}
+
+bool switch_lowering::add_case(long long value)
+{
+    if (find(labels.begin(), labels.end(), value) != labels.end())
+    {
+        return false; // Duplicate case value
+    }
+
+    labels.push_back(value);
+    return true;
+}
+
+bool switch_lowering::set_default()
+{
+    if (has_default)
+    {
+        return false; // Multiple default labels
+    }
+
+    has_default = true;
+    return true;
+}
+
+int switch_lowering::get_case_count()
+{
+    return labels.size();
+}
+
+string switch_lowering::choose_lowering()
+{
+    string fallback = has_default ? "default" : "end of switch";
+    int n = labels.size();
+
+    if (n == 0)
+    {
+        return "jump to " + fallback;
+    }
+
+    vector<long long> sorted_labels = labels;
+    sort(sorted_labels.begin(), sorted_labels.end());
+
+    long long low = sorted_labels.front();
+    long long high = sorted_labels.back();
+    long long range = high - low + 1;
+    double density = (double)n / (double)range;
+
+    if (n <= SWITCH_CHAIN_MAX_CASES)
+    {
+        return "compare chain, " + to_string(n) + " compares, miss goes to " + fallback;
+    }
+
+    if (density >= SWITCH_TABLE_MIN_DENSITY && range <= SWITCH_TABLE_MAX_RANGE)
+    {
+        // One unsigned bounds check covers both ends: (unsigned)(x - low) < range
+        ostringstream plan;
+        plan << "jump table, " << n << " cases, range [" << low << ", " << high << "], "
+             << range << " slots, density " << fixed << setprecision(2) << density
+             << ", holes and out of range go to " << fallback;
+        return plan.str();
+    }
+
+    int depth = 0;
+    while ((1LL << depth) <= n)
+    {
+        depth++;
+    }
+
+    return "binary decision tree, " + to_string(n) + " cases, depth " + to_string(depth) +
+           ", pivot " + to_string(sorted_labels[n / 2]) + ", miss goes to " + fallback;
+}
+
+switch_lowering::~switch_lowering()
+{
+    labels.clear();
+}
@@ -0,0 +1,191 @@
+#include<bits/stdc++.h>
+using namespace std;
+
+// Token buffers between the scanner and the parser. The whole input is read
+// once, split into chunks at brace depth zero right after a top-level unit
+// ends, and each chunk is scanned by its own reentrant scanner on its own
+// thread. The parser then takes the tokens back in input order; every token
+// carries its newline count within its chunk, so `lines` comes out exactly
+// as it does when one scanner reads the whole file.
+
+class symbol_info;
+
+class scan_state
+{
+public:
+    int lines;              // newlines seen so far in this chunk
+    symbol_info *lval;      // semantic value of the last token returned
+    string echo;            // characters no rule matched, in input order
+
+    scan_state()
+    {
+        this->lines = 0;
+        this->lval = NULL;
+    }
+};
+
+class lexed_token
+{
+public:
+    int kind;
+    symbol_info *value;
+    int newlines;           // newlines in the chunk up to and including this token
+
+    lexed_token(int kind, symbol_info *value, int newlines)
+    {
+        this->kind = kind;
+        this->value = value;
+        this->newlines = newlines;
+    }
+};
+
+// Scans one chunk with a fresh scanner; defined in the scanner file. Returns the newline count.
+int lex_chunk(const char *text, size_t length, vector<lexed_token> &out, string &echo);
+
+// Scans the same text with flex and with the SIMD scanner; 0 when the token streams match
+int check_scanners(const char *text, size_t length, string &report);
+
+class token_stream
+{
+private:
+    string input;
+    vector<vector<lexed_token>> chunks;
+    vector<int> lines_before;       // newlines in all earlier chunks
+    int total_newlines;
+    size_t chunk_index;
+    size_t token_index;
+    double lex_millis;
+
+    vector<size_t> find_split_points(int parts)
+    {
+        // One pass over the braces; a split goes at the first depth-zero ';' or '}'
+        // at or after each ideal offset, so no unit is cut in two
+        vector<size_t> points;
+        points.push_back(0);
+
+        size_t target = input.size() / parts;
+        int depth = 0;
+        for (size_t i = 0; i < input.size() && (int)points.size() < parts; i++)
+        {
+            char c = input[i];
+            if (c == '{') depth++;
+            else if (c == '}') depth--;
+
+            if (depth == 0 && (c == ';' || c == '}') && i + 1 >= points.size() * target)
+            {
+                points.push_back(i + 1);
+            }
+        }
+
+        points.push_back(input.size());
+        return points;
+    }
+
+public:
+    token_stream()
+    {
+        this->total_newlines = 0;
+        this->chunk_index = 0;
+        this->token_index = 0;
+        this->lex_millis = 0;
+    }
+
+    bool load(FILE *in, int threads)
+    {
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        {
+            input.append(buffer, n);
+        }
+        if (ferror(in))
+            return false;
+
+        auto start = chrono::steady_clock::now();
+
+        vector<size_t> points = find_split_points(max(threads, 1));
+        int count = points.size() - 1;
+        chunks.assign(count, vector<lexed_token>());
+        vector<string> echoes(count);
+        vector<int> newlines(count, 0);
+
+        auto scan = [&](int c)
+        {
+            newlines[c] = lex_chunk(input.data() + points[c], points[c + 1] - points[c], chunks[c], echoes[c]);
+        };
+
+        vector<thread> workers;
+        for (int c = 1; c < count; c++)
+        {
+            workers.push_back(thread(scan, c));
+        }
+        scan(0);
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        lex_millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        lines_before.assign(count, 0);
+        total_newlines = 0;
+        for (int c = 0; c < count; c++)
+        {
+            lines_before[c] = total_newlines;
+            total_newlines += newlines[c];
+            fputs(echoes[c].c_str(), stdout);
+        }
+
+        chunk_index = 0;
+        token_index = 0;
+        return true;
+    }
+
+    int next(symbol_info *&value, int &line)
+    {
+        while (chunk_index < chunks.size() && token_index == chunks[chunk_index].size())
+        {
+            chunk_index++;
+            token_index = 0;
+        }
+
+        if (chunk_index == chunks.size())
+        {
+            line = 1 + total_newlines;
+            return 0;
+        }
+
+        lexed_token &token = chunks[chunk_index][token_index++];
+        line = 1 + lines_before[chunk_index] + token.newlines;
+        if (token.value != NULL)
+        {
+            value = token.value;
+        }
+        return token.kind;
+    }
+
+    size_t get_token_count()
+    {
+        size_t count = 0;
+        for (auto &chunk : chunks)
+        {
+            count += chunk.size();
+        }
+        return count;
+    }
+
+    int get_chunk_count()
+    {
+        return chunks.size();
+    }
+
+    double get_lex_millis()
+    {
+        return lex_millis;
+    }
+
+    bool check_scanners(string &report)
+    {
+        return ::check_scanners(input.data(), input.size(), report) == 0;
+    }
+};